@@ -0,0 +1,74 @@
+// 物理ページの割り当ての速さを測る。
+// 1, 2, 4, 8個のワーカがsbrk()でNPAGEページ伸ばして触れ、縮めることを
+// 繰り返し、1秒あたりのページの割り当て数を表示する
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "mmu.h"
+
+#define NPAGE  64    // ページ数/1回のsbrk()
+#define NITER  200   // sbrk()の繰り返し回数/ワーカ
+#define HZ     100   // 1秒あたりのtick数(おおよそ)
+
+// 1つのワーカプロセスの処理
+void
+worker(void)
+{
+  int i, j;
+  char *p;
+
+  for(i = 0; i < NITER; i++){
+    p = sbrk(NPAGE*PGSIZE);
+    if(p == (char*)-1){
+      printf(1, "allocbench: sbrk failed\n");
+      exit();
+    }
+    for(j = 0; j < NPAGE; j++)
+      p[j*PGSIZE] = j;
+    if(sbrk(-NPAGE*PGSIZE) == (char*)-1){
+      printf(1, "allocbench: sbrk shrink failed\n");
+      exit();
+    }
+  }
+  exit();
+}
+
+// nproc個のワーカを同時に走らせ、割り当て速度を表示する
+void
+run(int nproc)
+{
+  int i, pid, start, elapsed, total;
+
+  start = uptime();
+  for(i = 0; i < nproc; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "allocbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0)
+      worker();
+  }
+  for(i = 0; i < nproc; i++)
+    wait();
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+
+  total = nproc * NITER * NPAGE;
+  printf(1, "%d procs: %d allocs in %d ticks, %d allocs/sec\n",
+         nproc, total, elapsed, total / elapsed * HZ);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  printf(1, "allocbench starting\n");
+  for(n = 1; n <= 8; n *= 2)
+    run(n);
+  printf(1, "allocbench ok\n");
+  exit();
+}
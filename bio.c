@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -25,81 +25,215 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "mmu.h"
+
+// (dev, blockno)で引くハッシュ表のバケット数(素数)
+#define NBUCKET 1021
+#define HASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+// ハッシュ表の1つのバケット
+struct bucket {
+  struct spinlock lock; // このバケットのチェインと各バッファのrefcntを保護する
+  struct buf *head;     // hnextで繋いだバッファのチェイン
+};
+
+int nbuf; // バッファの数。binit()が空きメモリ量から決める
 
 struct {
-  struct spinlock lock; // ロック用の変数
-  struct buf buf[NBUF]; // バッファキャッシュのリスト
+  struct bucket bucket[NBUCKET]; // キャッシュ検索用のハッシュ表
 
-  // 全てのバッファの双方向リスト
-  // head.nextが一番最近使用したものになる
-  struct buf head;
+  // 参照カウンタが0のバッファだけを繋ぐ双方向リスト(追い出し候補)
+  // lru.nextが一番最近使用したものになる
+  struct spinlock lock; // lruを保護する。バケットのロックより後に取得する
+  struct buf lru;
+
+  // キャッシュミス時のバッファの入れ替えを直列化する。
+  // これを保持している間だけ2つのバケットのロックを同時に保持してよい。
+  struct spinlock evictlock;
 } bcache; // バッファキャッシュ
 
-// 双方向のキャッシュリストの初期化
+// 追い出し候補のリストからbを外す。bcache.lockを保持していること
+static void
+lruremove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// 追い出し候補のリストの先頭(MRU)にbを繋ぐ。bcache.lockを保持していること
+static void
+lrupush(struct buf *b)
+{
+  b->next = bcache.lru.next;
+  b->prev = &bcache.lru;
+  bcache.lru.next->prev = b;
+  bcache.lru.next = b;
+}
+
+// バケットのチェインからbを外す。バケットのロックを保持していること
+static void
+bucketremove(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      return;
+    }
+  }
+  panic("bucketremove");
+}
+
+// バケットからdev, blocknoのバッファを探し、見つかれば参照カウンタを増やして返す。
+// バケットのロックを保持していること
+static struct buf*
+bucketget(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      if(b->refcnt++ == 0){ // 追い出し候補から外す
+        acquire(&bcache.lock);
+        lruremove(b);
+        release(&bcache.lock);
+      }
+      return b;
+    }
+  }
+  return 0;
+}
+
+// ハッシュ表と追い出し候補のリストの初期化。
+// buf構造体はkalloc()したページに詰めて確保し、データには1つずつページを
+// 割り当てる(ページにアラインされるためDMAでもそのまま転送できる)。
+// 空きメモリの1/BUFMEM(最大NBUFMAX個)をキャッシュに使う。kinit2()の後に呼び出すこと。
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
+  char *p;
+  int npage;
 
   // バッファキャッシュ用ロックの初期化
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.evictlock, "bcache.evict");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
 
 //PAGEBREAK!
   // 双方向のバッファリストの作成
   // ヘッドで前後を初期化
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-
-  // バッファリストを初期化
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    // headとその次の要素との間に繋ぐ
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  bcache.lru.prev = &bcache.lru;
+  bcache.lru.next = &bcache.lru;
+
+  // 全てのバッファは未使用として追い出し候補に入れる。
+  // 識別子はバケットに散らばるよう、使われていないデバイス0のブロック番号を振る。
+  if(BSIZE > PGSIZE)
+    panic("binit: BSIZE");
+  npage = kfreepages() / BUFMEM;
+  p = 0;
+  b = 0;
+  while(nbuf < NBUFMAX && npage > 0){
+    if(p == 0 || (char*)(b+1) > p+PGSIZE){ // buf構造体用のページを確保
+      if((p = kalloc()) == 0)
+        break;
+      memset(p, 0, PGSIZE);
+      b = (struct buf*)p;
+      npage--;
+    }
+    if(npage == 0 || (b->data = (uchar*)kalloc()) == 0)
+      break;
+    npage--;
     initsleeplock(&b->lock, "buffer"); // ロックの初期化
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->dev = 0;
+    b->blockno = nbuf++;
+    bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+    b->hnext = bk->head;
+    bk->head = b;
+    lrupush(b);
+    b++;
   }
+  if(nbuf == 0)
+    panic("binit: no buffers");
 }
 
 // デバイスのブロックがバッファキャッシュに存在する確認し
 // もしなければバッファを割り当てる
 // もし存在すればロックされたバッファを返す。
+// キャッシュにあればそのブロックのバケットのロックだけで済み、
+// 他のCPUによる別のブロックの検索とは競合しない。
 static struct buf* bget(uint dev, uint blockno)
 {
   struct buf *b;
+  struct bucket *bk, *old;
 
-  acquire(&bcache.lock); // バッファキャッシュリスト用のロックを取得
+  bk = &bcache.bucket[HASH(dev, blockno)];
 
   // Is the block already cached?
-  // ブロックキャッシュのリストをトラバースしていく
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    // デバイス番号及びブロック番号が同じ場合
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++; // 参照回数をインクリメント
-      release(&bcache.lock); // ロックを開放
-      acquiresleep(&b->lock); // バッファをロックできるまで待機
-      return b; // バッファキャッシュを返す
-    }
+  acquire(&bk->lock);
+  if((b = bucketget(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    acquiresleep(&b->lock); // バッファをロックできるまで待機
+    return b; // バッファキャッシュを返す
   }
+  release(&bk->lock);
 
   // キャッシュされていない場合、使用されていないバッファをリサイクルする。
+  // 入れ替えは1つずつ行う。ロックを取り直す間に他のプロセスが
+  // 同じブロックを読み込んでいるかもしれないので再度検索する。
+  acquire(&bcache.evictlock);
+  acquire(&bk->lock);
+  if((b = bucketget(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    release(&bcache.evictlock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+
   // 参照カウンタ(refcnt)が0であっても、flagsに"B_DIRTY"が設定されている場合は
   // バッファは使用中であることを示す、なせなら
   // log.cは変更されているがコミットしていないためである。
-  // バッファキャッシュのリストを使用頻度の低い順にトラバースしていく
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    // 参照カウンタが0且つflagsにB_DIRTYが設定されていない == 使用されていない
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev; // デバイス番号
-      b->blockno = blockno; // ブロック番号
-      b->flags = 0; // フラグをクリア
-      b->refcnt = 1; // 参照カウンタを設定
-      release(&bcache.lock); // バッファキャッシュのロックを開放
-      acquiresleep(&b->lock); // バッファキャッシュリストのロックを取得
-      return b; // バッファキャッシュを返す
-    }
+  // 追い出し候補を使用頻度の低い順にトラバースしていく
+  for(;;){
+    acquire(&bcache.lock);
+    for(b = bcache.lru.prev; b != &bcache.lru; b = b->prev)
+      if((b->flags & B_DIRTY) == 0)
+        break;
+    release(&bcache.lock);
+    if(b == &bcache.lru)
+      panic("bget: no buffers"); // キャッシュが見つからなかった
+
+    // 候補の識別子はevictlockで守られているので変わらない。
+    // 元のバケットのロックを取った上で、まだ使われていないことを確かめる。
+    old = &bcache.bucket[HASH(b->dev, b->blockno)];
+    if(old != bk)
+      acquire(&old->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      break;
+    if(old != bk)
+      release(&old->lock);
   }
-  panic("bget: no buffers"); // キャッシュが見つからなかった
+
+  acquire(&bcache.lock);
+  lruremove(b);
+  release(&bcache.lock);
+  bucketremove(old, b);
+  if(old != bk)
+    release(&old->lock);
+
+  b->dev = dev; // デバイス番号
+  b->blockno = blockno; // ブロック番号
+  b->flags = 0; // フラグをクリア
+  b->refcnt = 1; // 参照カウンタを設定
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.evictlock);
+  acquiresleep(&b->lock); // バッファのロックを取得
+  return b; // バッファキャッシュを返す
 }
 
 // 指定のブロックデータを保持するバッファをロックされた状態で返す
@@ -115,6 +249,65 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// ディスクから読まずにブロックのロックしたバッファを返す。
+// 呼び出し元はbrelse()までにデータ全体を書き換えること
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// blocknoから連続するn個(MAXRUN以下)のブロックを読み込み、ロックしたバッファを
+// bv[]に返す。キャッシュにないブロックはまとめてドライバに渡し、
+// 隣接するセクタを1つのコマンドで読ませる。
+// 複数のバッファを保持するため、ロックはブロック番号の昇順に取得する
+// (log.cのinstall_trans()も同じ順序で取得する)。
+void
+breadv(uint dev, uint blockno, struct buf **bv, int n)
+{
+  struct buf *rv[MAXRUN];
+  int i, nr;
+
+  if(n > MAXRUN)
+    panic("breadv");
+  nr = 0;
+  for(i = 0; i < n; i++){
+    bv[i] = bget(dev, blockno + i);
+    if((bv[i]->flags & B_VALID) == 0)
+      rv[nr++] = bv[i];
+  }
+  if(nr > 0)
+    iderwv(rv, nr);
+}
+
+// blocknoから連続するn個(MAXRUN以下)のブロックを先読みする。
+// キャッシュにないものだけをドライバに渡し、読み込みの完了は待たない。
+// 渡したバッファは転送中ロックされたままなので、その間にbread()した
+// プロセスは読み込みが終わるまでbget()で待つ。
+void
+breada(uint dev, uint blockno, int n)
+{
+  struct buf *rv[MAXRUN], *b;
+  int i, nr;
+
+  if(n > MAXRUN)
+    panic("breada");
+  nr = 0;
+  for(i = 0; i < n; i++){
+    b = bget(dev, blockno + i);
+    if(b->flags & B_VALID)
+      brelse(b);
+    else
+      rv[nr++] = b;
+  }
+  if(nr > 0)
+    idereada(rv, nr);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -125,8 +318,46 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// n個のバッファをまとめてディスクに書き込む。全てロックされていること。
+// ドライバがブロック番号順に並べ替え、隣接するものは1つのコマンドにまとめる。
+void
+bwritev(struct buf **bv, int n)
+{
+  int i;
+
+  if(n == 0)
+    return;
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bv[i]->lock))
+      panic("bwritev");
+    bv[i]->flags |= B_DIRTY;
+  }
+  iderwv(bv, n);
+}
+
+// バッファのロックを開放した後、参照を1つ減らす
+// 誰も参照しなくなれば追い出し候補のリストの先頭(MRU)に返す
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+
+  // 参照している間は識別子が変わらないのでバケットは決まっている
+  bk = &bcache.bucket[HASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
+  b->refcnt--; // バッファを開放するので参照カウンタをデクリメント
+
+  // 参照カウンタが0の場合は追い出し候補のリストの先頭に繋ぐ
+  if (b->refcnt == 0) {
+    acquire(&bcache.lock);
+    lrupush(b);
+    release(&bcache.lock);
+  }
+
+  release(&bk->lock);
+}
+
 // ロックされたバッファを開放する
-// MRU(Most Recently Used)リストの先頭に返す
 void
 brelse(struct buf *b)
 {
@@ -136,26 +367,16 @@ brelse(struct buf *b)
 
   // 当該ロック待ちのプロセスを起床させる
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  // バッファキャッシュのリストのロックを取得
-  acquire(&bcache.lock);
-  b->refcnt--; // バッファを開放するので参照カウンタをデクリメント
-
-  // 参照カウンタが0の場合はバッファキャッシュリストの先頭に繋ぐ
-  if (b->refcnt == 0) {
-    // 当該バッファキャッシュの前後の要素を繋ぐ
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-
-    // 当該バッファキャッシュをリストの先頭に繋ぐ
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  // バッファキャッシュリストのロックを開放
-  release(&bcache.lock);
+// 先読みの転送が終わったバッファを、breada()を呼んだプロセスに代わって
+// 開放する。ideintr()から呼ばれる
+void
+bdone(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bput(b);
 }
 //PAGEBREAK!
 // Blank page.
@@ -5,11 +5,14 @@ struct buf {
   uint blockno; // ブロック番号
   struct sleeplock lock; // スピンロック用変数
   uint refcnt; // 参照回数
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // LRU cache list(参照されていない間だけ繋がる)
   struct buf *next;
+  struct buf *hnext; // 同じハッシュバケットの次のバッファ
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uchar *data; // BSIZEバイトのデータ。ページにアラインされている(binit()を参照)
 };
 #define B_VALID 0x2  // バッファはディスクから読み込まれたものである
 #define B_DIRTY 0x4  // バッファをディスクに書き戻す必要がある。
+#define B_ASYNC 0x8  // 先読み中。転送が終わるとideintr()がロックと参照を手放す
+#define B_ORDERED 0x10 // ファイルのデータで、今のトランザクションのコミット前に書き込む
 
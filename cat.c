@@ -2,7 +2,7 @@
 #include "stat.h"
 #include "user.h"
 
-char buf[512];
+char buf[4096]; // 1ブロック(BSIZE)ずつ読む
 
 void
 cat(int fd)
@@ -0,0 +1,99 @@
+// 小さいファイルの作成と削除の速さを測る。
+// 各ワーカがNFILE個のファイルを作ってFSIZEバイト書き込み、fsync()してから
+// 削除し、1秒あたりのファイル数を表示する
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define NFILE  100   // ファイル数/ワーカ
+#define FSIZE  100   // 1ファイルに書き込むバイト数
+#define HZ     100   // 1秒あたりのtick数(おおよそ)
+
+char buf[FSIZE];
+
+// ワーカidの作るi番目のファイル名をnameに設定する
+void
+fname(char *name, int id, int i)
+{
+  name[0] = 'c';
+  name[1] = 'b';
+  name[2] = '0' + id;
+  name[3] = '0' + i / 100;
+  name[4] = '0' + (i / 10) % 10;
+  name[5] = '0' + i % 10;
+  name[6] = 0;
+}
+
+// 1つのワーカプロセスの処理
+void
+worker(int id)
+{
+  char name[8];
+  int i, fd;
+
+  for(i = 0; i < NFILE; i++){
+    fname(name, id, i);
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf(1, "createbench: create %s failed\n", name);
+      exit();
+    }
+    if(write(fd, buf, FSIZE) != FSIZE){
+      printf(1, "createbench: write %s failed\n", name);
+      exit();
+    }
+    if(i == NFILE-1)
+      fsync(fd);
+    close(fd);
+  }
+  for(i = 0; i < NFILE; i++){
+    fname(name, id, i);
+    if(unlink(name) < 0){
+      printf(1, "createbench: unlink %s failed\n", name);
+      exit();
+    }
+  }
+  exit();
+}
+
+// nproc個のワーカを同時に走らせ、ファイル作成速度を表示する
+void
+run(int nproc)
+{
+  int i, pid, start, elapsed, total;
+
+  start = uptime();
+  for(i = 0; i < nproc; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "createbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0)
+      worker(i);
+  }
+  for(i = 0; i < nproc; i++)
+    wait();
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+
+  total = nproc * NFILE;
+  printf(1, "%d procs: %d files in %d ticks, %d files/sec\n",
+         nproc, total, elapsed, total * HZ / elapsed);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  printf(1, "createbench starting\n");
+  memset(buf, 'x', sizeof(buf));
+  for(n = 1; n <= 4; n *= 2)
+    run(n);
+  printf(1, "createbench ok\n");
+  exit();
+}
@@ -0,0 +1,138 @@
+// Directory name lookup cache.
+//
+// (親ディレクトリのdev, inum, 名前) -> inum の対応を覚えておき、
+// dirlookup()がディレクトリのブロックを読まずに済むようにする。
+// 見つからなかった名前も否定エントリ(inumが0)として覚える。
+//
+// エントリはディレクトリの内容と常に一致させる。dirlookup()は
+// ディレクトリのロックを(読み手として)保持したまま検索結果を登録し、
+// ディレクトリを書き換えるdirlink()とunlinkは書き手として保持したまま
+// エントリを更新するため、古い結果が残ることはない。
+// ディレクトリのinodeが解放されたら、その中の名前のエントリを全て捨てる。
+//
+// 表はハッシュ表で、検索は読み手、更新は書き手としてdcache.lockを取る。
+// 空きがなければ時計の針の順にエントリを置き換える。
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "fs.h"
+
+#define NDCACHE 512
+#define NDHASH  251
+
+struct dentry {
+  uint dev;
+  uint dinum;           // 親ディレクトリのinode番号(0なら未使用)
+  char name[DIRSIZ];
+  uint inum;            // 名前のinode番号(0なら否定エントリ)
+  uint off;             // ディレクトリ内のエントリのオフセット
+  struct dentry *next;  // 同じハッシュのエントリ
+};
+
+static struct {
+  struct rwspinlock lock;
+  struct dentry *hash[NDHASH];
+  struct dentry ent[NDCACHE];
+  uint hand;            // 次に置き換えるエントリ
+} dcache;
+
+void
+dcacheinit(void)
+{
+  initrwlock(&dcache.lock, "dcache");
+}
+
+static uint
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h;
+  int i;
+
+  h = dev * 31 + dinum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+// dcache.lockを保持していること
+static struct dentry*
+dfind(uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dinum, name)]; d; d = d->next)
+    if(d->dinum == dinum && d->dev == dev && strncmp(d->name, name, DIRSIZ) == 0)
+      return d;
+  return 0;
+}
+
+// dをハッシュ表から外す。dcache.lockを書き手として保持していること
+static void
+dunlink(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dinum, d->name)]; *pp != d; pp = &(*pp)->next)
+    ;
+  *pp = d->next;
+  d->dinum = 0;
+}
+
+// ディレクトリ(dev, dinum)のnameを探す。見つかれば1を返し、*inumと*offを設定する。
+// *inumが0であればその名前は存在しない
+int
+dcachelookup(uint dev, uint dinum, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+  int r = 0;
+
+  acquirerd(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) != 0){
+    *inum = d->inum;
+    *off = d->off;
+    r = 1;
+  }
+  releaserd(&dcache.lock);
+  return r;
+}
+
+// ディレクトリ(dev, dinum)のnameがinum(0なら存在しない)であることを登録する。
+// ディレクトリのロックを保持して呼ぶこと
+void
+dcacheenter(uint dev, uint dinum, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+  uint h;
+
+  acquirewr(&dcache.lock);
+  if((d = dfind(dev, dinum, name)) == 0){
+    d = &dcache.ent[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDCACHE;
+    if(d->dinum)
+      dunlink(d);
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(dev, dinum, name);
+    d->next = dcache.hash[h];
+    dcache.hash[h] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  releasewr(&dcache.lock);
+}
+
+// 解放されたディレクトリ(dev, dinum)の中の名前のエントリを全て捨てる
+void
+dcachepurge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  acquirewr(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDCACHE]; d++)
+    if(d->dinum == dinum && d->dev == dev)
+      dunlink(d);
+  releasewr(&dcache.lock);
+}
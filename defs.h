@@ -7,14 +7,22 @@ struct proc;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
+struct rwsleeplock;
+struct rwspinlock;
 struct stat;
 struct superblock;
 
 // bio.c
+extern int      nbuf;
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
+void            breadv(uint, uint, struct buf**, int);
+void            breada(uint, uint, int);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
 
 // console.c
 void            consoleinit(void);
@@ -22,6 +30,12 @@ void            cprintf(char*, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// dcache.c
+void            dcacheinit(void);
+int             dcachelookup(uint, uint, char*, uint*, uint*);
+void            dcacheenter(uint, uint, char*, uint, uint);
+void            dcachepurge(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -31,6 +45,7 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             filereaddir(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
@@ -38,12 +53,15 @@ int             filewrite(struct file*, char*, int n);
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+int             dirread(struct inode*, char*, uint*, int);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -57,6 +75,8 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
+void            idereada(struct buf**, int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -65,7 +85,10 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+void            kdup(char*);
 void            kfree(char*);
+int             kfreepages(void);
+int             krefcnt(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -78,14 +101,23 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicipi(int, int);
+void            lapiconeshot(uint);
+uint            lapicperiodic(void);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+void            log_ordered(struct buf*);
+void            log_free(uint);
+int             log_freed(uint);
 void            begin_op();
 void            end_op();
+void            begin_opdata(void);
+void            end_opdata(void);
+void            log_sync(void);
 
 // mp.c
 extern int      ismp;
@@ -106,17 +138,28 @@ int             pipewrite(struct pipe*, char*, int);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             futexwait(uint, uint*, uint);
+int             futexwake(uint*, int);
+int             clone(void(*)(void*, void*), void*, void*, void*);
 int             growproc(int);
+int             join(void**);
 int             kill(int);
+int             kproc(char*, void(*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
+void            reapthreads(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            schedboost(void);
+void            schedtick(void);
+int             setpriority(int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+void            tlbshootdown(pde_t*);
 void            userinit(void);
+struct spinlock* vmlock(struct proc*);
 int             wait(void);
 void            wakeup(void*);
 void            yield(void);
@@ -129,6 +172,12 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            lockdump(void);
+void            initrwlock(struct rwspinlock*, char*);
+void            acquirerd(struct rwspinlock*);
+void            releaserd(struct rwspinlock*);
+void            acquirewr(struct rwspinlock*);
+void            releasewr(struct rwspinlock*);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
@@ -138,6 +187,12 @@ void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            acquirerdsleep(struct rwsleeplock*);
+void            releaserdsleep(struct rwsleeplock*);
+void            acquirewrsleep(struct rwsleeplock*);
+void            releasewrsleep(struct rwsleeplock*);
+int             holdingwrsleep(struct rwsleeplock*);
+void            initrwsleeplock(struct rwsleeplock*, char*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -151,6 +206,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argwptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -164,6 +220,9 @@ void            idtinit(void);
 extern uint     ticks;
 void            tvinit(void);
 extern struct spinlock tickslock;
+int             sleepticks(int);
+void            timeridle(void);
+void            timerresume(void);
 
 // uart.c
 void            uartinit(void);
@@ -175,12 +234,17 @@ void            seginit(void);
 void            kvmalloc(void);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
+char*           uva2kaw(pde_t*, uint);
+int             uvmwritable(pde_t*, uint, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, uint*, int);
+int             cowfault(pde_t*, uint);
+int             lazyfault(pde_t*, uint);
+int             uvmtouch(pde_t*, uint, uint, int);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
@@ -19,6 +19,10 @@ exec(char *path, char **argv)
   pde_t *pgdir, *oldpgdir;
   struct proc *curproc = myproc();
 
+  // 他のスレッドが使っているページテーブルは置き換えられない
+  if(curproc->leader != curproc)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -94,6 +98,7 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  reapthreads();
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -5,6 +5,7 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
@@ -114,6 +115,24 @@ fileread(struct file *f, char *addr, int n)
   panic("fileread");
 }
 
+// ディレクトリのファイルfから使われているエントリをまとめて読む
+int
+filereaddir(struct file *f, char *addr, int n)
+{
+  int r;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  if(f->ip->type != T_DIR){
+    iunlock(f->ip);
+    return -1;
+  }
+  r = dirread(f->ip, addr, &f->off, n);
+  iunlock(f->ip);
+  return r;
+}
+
 //PAGEBREAK!
 // Write to file f.
 int
@@ -127,24 +146,25 @@ filewrite(struct file *f, char *addr, int n)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size.
+    // データブロックはログに書かないので(log_ordered()を参照)、ログに入るのは
+    // inode、ビットマップ、間接・二重間接ブロックだけでMAXOPBLOCKSに収まる。
+    // データブロックの数は境界をまたぐ1ブロックを含めてMAXOPDATAまで。
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+    int max = (MAXOPDATA-1) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opdata();
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
-      end_op();
+      end_opdata();
 
       if(r < 0)
         break;
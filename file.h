@@ -13,7 +13,7 @@ struct inode {
   uint dev;           // デバイス番号
   uint inum;          // inode番号
   int ref;            // 参照カウンタ
-  struct sleeplock lock; // ここから下の全てのメンバを保護するためのロック
+  struct rwsleeplock lock; // ここから下の全てのメンバを保護するためのロック
   int valid;          // inodeがディスクから読み込まれているか
 
   short type;         // ディスクinodeのコピー
@@ -21,7 +21,17 @@ struct inode {
   short minor;        // マイナー番号
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1]; // 
+  uint addrs[NDIRECT+2]; // 
+
+  // 順次読み込みの検出と先読み(readi()を参照)
+  uint ranext;        // 次に読まれれば順次とみなすブロック
+  uint rawin;         // 先読みの窓のブロック数(0なら先読みしない)
+  uint raend;         // ここより前のブロックは先読みを出してある
+
+  // icache.lockが保護する
+  struct inode *hnext; // 同じハッシュのinode
+  struct inode *prev;  // 参照されていないinodeのLRUリスト
+  struct inode *next;
 };
 
 // メジャーデバイス番号とそれに対応する関数がマッピングされたテーブル
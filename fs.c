@@ -40,41 +40,57 @@ readsb(int dev, struct superblock *sb)
 }
 
 // Zero a block.
+// 古い内容は読まない。dataが真ならファイルのデータなので
+// ログには書かず、コミット前に書き込む(log_ordered()を参照)
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bnew(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_ordered(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
 // Allocate a zeroed disk block.
+// ビットマップをgoal(0なら先頭)から探すので、ファイルの直前のブロックの次を
+// goalにすればデータがディスク上で連続して並び、まとめて読み書きできる。
+// dataはbzero()に渡す
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int data)
 {
-  int b, bi, m;
+  uint i, b, bi, m;
   struct buf *bp;
 
+  if(goal >= sb.size)
+    goal = 0;
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+  for(i = 0; i < sb.size; i++){
+    b = (goal + i) % sb.size;
+    if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+      if(bp)
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    bi = b % BPB;
+    m = 1 << (bi % 8);
+    // Is block free? 未コミットの解放で空いたブロックは使わない
+    if((bp->data[bi/8] & m) == 0 && !log_freed(b)){
+      bp->data[bi/8] |= m;  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      bzero(dev, b, data);
+      return b;
     }
-    brelse(bp);
   }
+  if(bp)
+    brelse(bp);
   panic("balloc: out of blocks");
 }
 
@@ -94,6 +110,7 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
 }
 
 // Inodes.
@@ -132,7 +149,8 @@ bfree(int dev, uint b)
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode. An entry whose ref
+//   has fallen to zero stays valid until it is recycled.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -161,31 +179,89 @@ bfree(int dev, uint b)
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
 //
+// キャッシュは(dev, inum)で引くハッシュ表で、参照されなくなった
+// inodeも内容を保ったまま残し、再びiget()されればディスクから
+// 読み直さずに使う。入れ替えるのは参照されていないinodeのうち
+// 最も前に使われたもの(LRU)。
+//
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+// (dev, inum)で引くハッシュ表のバケット数(素数)
+#define NIHASH 251
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 // inode用のキャッシュ
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *hash[NIHASH]; // hnextで繋いだinodeのチェイン
+  struct inode lru;           // 参照されていないinode。lru.nextが一番最近使用したもの
 } icache;
 
+int ninode; // キャッシュするinodeの数。iinit()が決める
+
+// LRUリストからipを外す。icache.lockを保持していること
+static void
+ilruremove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+}
+
+// LRUリストの先頭(MRU)にipを繋ぐ。icache.lockを保持していること
+static void
+ilrupush(struct inode *ip)
+{
+  ip->next = icache.lru.next;
+  ip->prev = &icache.lru;
+  icache.lru.next->prev = ip;
+  icache.lru.next = ip;
+}
+
+// inodeのキャッシュを作る。ディスク上のinodeを全て保持できる数を目安に、
+// 空きメモリの1/INODEMEMまで(少なくともNINODE個)確保する。
+// inode構造体はkalloc()したページに詰めて置く
 void
 iinit(int dev)
 {
-  int i = 0;
-  
+  struct inode *ip;
+  char *p;
+  int max, npage;
+
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.lru.prev = &icache.lru;
+  icache.lru.next = &icache.lru;
 
   readsb(dev, &sb);
-  cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
-          sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+
+  max = sb.ninodes;
+  npage = kfreepages() / INODEMEM;
+  if(max > npage * (PGSIZE / sizeof(struct inode)))
+    max = npage * (PGSIZE / sizeof(struct inode));
+  if(max < NINODE)
+    max = NINODE;
+  p = 0;
+  ip = 0;
+  while(ninode < max){
+    if(p == 0 || (char*)(ip+1) > p+PGSIZE){
+      if((p = kalloc()) == 0)
+        break;
+      memset(p, 0, PGSIZE);
+      ip = (struct inode*)p;
+    }
+    initrwsleeplock(&ip->lock, "inode");
+    ilrupush(ip); // inumが0のinodeはハッシュ表に入っていない
+    ninode++;
+    ip++;
+  }
+  if(ninode == 0)
+    panic("iinit: no inodes");
+
+  cprintf("sb: size %d nblocks %d ninodes %d nlog %d nloghead %d logstart %d\
+ inodestart %d bmap start %d icache %d\n", sb.size, sb.nblocks,
+          sb.ninodes, sb.nlog, sb.nloghead, sb.logstart, sb.inodestart,
+          sb.bmapstart, ninode);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -244,34 +320,40 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
+  int h = IHASH(dev, inum);
 
   acquire(&icache.lock); // inodeのキャッシュ用ロックを取得
 
-  // そのinodeが既にキャッシュされているか
-  empty = 0;
-  // inodeのキャッシュをトラバース
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    // 参照されており、デバイス番号及びinode番号が一致すれば、そのinodeを返す
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++; // 参照カウンタをインクリメント
+  // そのinodeが既にキャッシュされているか。
+  // 参照されていなくても内容が有効であればそのまま使える
+  for(ip = icache.hash[h]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0) // 参照カウンタをインクリメント
+        ilruremove(ip);
       release(&icache.lock); // キャッシュのロックを開放
       return ip; // 発見したinodeを返す
     }
-    if(empty == 0 && ip->ref == 0)    // キャッシュ内の空のエントリを記録
-      empty = ip;
   }
 
-  // inodeのキャッシュエントリをリサイクル
-  if(empty == 0)
+  // 最も前に使われた参照されていないinodeをリサイクル
+  if((ip = icache.lru.prev) == &icache.lru)
     panic("iget: no inodes");
+  ilruremove(ip);
+  if(ip->inum != 0){
+    for(pp = &icache.hash[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+  }
 
   // inodeに必要な情報を設定
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = ip->rawin = ip->raend = 0;
+  ip->hnext = icache.hash[h];
+  icache.hash[h] = ip;
   release(&icache.lock); // ロックを開放
 
   return ip; // inodeを返す
@@ -300,7 +382,7 @@ void ilock(struct inode *ip)
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquiresleep(&ip->lock); // ロックが取得できるまでスリープして待機
+  acquirewrsleep(&ip->lock); // ロックが取得できるまでスリープして待機
 
   /* inodeが読み込まれていない場合、inodeを読み込み構造体にデータを設定する */
   if(ip->valid == 0){ // inodeが読み込まれていない場合
@@ -336,11 +418,34 @@ iunlock(struct inode *ip)
   // inodeのポインタが何も参照していない ||
   // カレントプロセスがロックを取得していない ||
   // 当該inodeが参照されていない場合
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || !holdingwrsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
   // スリープロックを開放し、そのロック上でスリープしているプロセスを起床させる。
-  releasesleep(&ip->lock);
+  releasewrsleep(&ip->lock);
+}
+
+// inodeを読み手としてロックする。内容を読むだけの場合に使い、
+// 同じinodeを他のプロセスも同時に読めるようにする。
+// inodeがまだ読み込まれていなければ、書き手としてロックして読み込む
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+  if(ip->valid == 0){
+    ilock(ip);
+    iunlock(ip);
+  }
+  acquirerdsleep(&ip->lock);
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+  releaserdsleep(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
@@ -353,23 +458,26 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquiresleep(&ip->lock);
+  acquirewrsleep(&ip->lock);
   if(ip->valid && ip->nlink == 0){
     acquire(&icache.lock);
     int r = ip->ref;
     release(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
+      if(ip->type == T_DIR)
+        dcachepurge(ip->dev, ip->inum);
       itrunc(ip);
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
     }
   }
-  releasesleep(&ip->lock);
+  releasewrsleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0) // 内容を保ったまま入れ替え候補にする
+    ilrupush(ip);
   release(&icache.lock);
 }
 
@@ -387,19 +495,56 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// blocks are reached through the doubly-indirect block
+// ip->addrs[NDIRECT+1], which lists indirect blocks.
+
+// 間接ブロックindのbn番目のエントリのブロックアドレスを返す。
+// なければ割り当てる。*nは呼び出し時に調べる最大のブロック数を、
+// 戻り時にはそこから物理的に連続しているブロック数を表す。
+static uint
+bmapind(struct inode *ip, uint ind, uint bn, uint *n)
+{
+  uint addr, *a, i, max;
+  struct buf *bp;
+
+  max = *n;
+  *n = 1;
+  bp = bread(ip->dev, ind);
+  a = (uint*)bp->data;
+  if((addr = a[bn]) == 0){
+    a[bn] = addr = balloc(ip->dev, bn > 0 && a[bn-1] ? a[bn-1]+1 : ind+1,
+                          ip->type != T_DIR);
+    log_write(bp);
+  }
+  for(i = bn+1; i < NINDIRECT && *n < max && a[i] == addr + *n; i++)
+    (*n)++;
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
+// *nには最大何ブロック先まで調べるかを渡し、戻り時にはbn番目から
+// ディスク上で連続して並んでいるブロック数(1以上)が入る。
+// 割り当てるのはbn番目のブロックだけで、続くブロックは既存のものに限る。
+// 連続する範囲は同じ間接ブロック内で数えるため、対応付けの読み込みは1回で済む。
+// 新しいブロックは直前のブロックの次から探し、ファイルが連続して並ぶようにする。
 static uint
-bmap(struct inode *ip, uint bn)
+bmap(struct inode *ip, uint bn, uint *n)
 {
-  uint addr, *a;
+  uint addr, i, max;
   struct buf *bp;
+  uint *a;
 
   if(bn < NDIRECT){
+    max = *n;
+    *n = 1;
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, bn > 0 && ip->addrs[bn-1] ? ip->addrs[bn-1]+1 : 0,
+                                    ip->type != T_DIR);
+    for(i = bn+1; i < NDIRECT && *n < max && ip->addrs[i] == addr + *n; i++)
+      (*n)++;
     return addr;
   }
   bn -= NDIRECT;
@@ -407,20 +552,46 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, ip->addrs[NDIRECT-1]+1, 0);
+    return bmapind(ip, addr, bn, n);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    // 二重間接ブロックから間接ブロックを引く。どちらもなければ割り当てる
+    if((addr = ip->addrs[NDIRECT+1]) == 0)
+      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev, 0, 0);
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+    if((addr = a[bn / NINDIRECT]) == 0){
+      a[bn / NINDIRECT] = addr = balloc(ip->dev, 0, 0);
       log_write(bp);
     }
     brelse(bp);
-    return addr;
+    return bmapind(ip, addr, bn % NINDIRECT, n);
   }
 
   panic("bmap: out of range");
 }
 
+// 間接ブロックindが指す全てのブロックとind自身を解放する
+static void
+itruncind(uint dev, uint ind)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, ind);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, ind);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -441,15 +612,20 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    itruncind(ip->dev, ip->addrs[NDIRECT]);
+    ip->addrs[NDIRECT] = 0;
+  }
+
+  if(ip->addrs[NDIRECT+1]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT+1]);
     a = (uint*)bp->data;
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
-        bfree(ip->dev, a[j]);
+        itruncind(ip->dev, a[j]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->addrs[NDIRECT+1]);
+    ip->addrs[NDIRECT+1] = 0;
   }
 
   ip->size = 0;
@@ -468,14 +644,50 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// ファイルのbnからlastまでのブロックを読んだところで呼び、順に読まれて
+// いれば先のブロックを先読みする。前回の続きから読まれるたびに窓を
+// 倍にし(RAMINからRAMAXまで)、離れた位置を読まれたら先読みをやめる。
+// 先読みした分の残りが窓の半分を切ったときだけ次を出す。
+// ipはロックしていること(先読みの状態はip->lockが保護する)
+static void
+readahead(struct inode *ip, uint bn, uint last)
+{
+  uint b, end, nb, n, addr;
+
+  if(bn == ip->ranext){ // 前回の続きから読まれた
+    ip->rawin = ip->rawin ? min(ip->rawin*2, RAMAX) : RAMIN;
+  } else if(bn + 1 != ip->ranext){ // 同じブロックの続きでもない
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->ranext = last + 1;
+  if(ip->rawin == 0 || ip->raend >= last + 1 + ip->rawin/2)
+    return;
+
+  // ファイルの中のブロックは全て割り当てられているので、
+  // bmap()が新たにブロックを割り当てることはない
+  nb = (ip->size + BSIZE - 1) / BSIZE;
+  b = ip->raend > last + 1 ? ip->raend : last + 1;
+  end = min(last + 1 + ip->rawin, nb);
+  while(b < end){
+    n = min(end - b, MAXRUN);
+    addr = bmap(ip, b, &n); // nはディスク上で連続している数に縮む
+    breada(ip->dev, addr, n);
+    b += n;
+  }
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
+// 順に読まれているファイルは、読んだ後に先のブロックを非同期に読み始める
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, addr, nrun, i, start;
+  struct buf *bv[MAXRUN];
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -487,23 +699,38 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n == 0)
+    return 0;
+  start = off;
 
+  // ディスク上で連続しているブロックはまとめて読み込む
+  nrun = i = 0;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if(i == nrun){
+      nrun = min((off + n - tot - 1)/BSIZE - off/BSIZE + 1, MAXRUN);
+      addr = bmap(ip, off/BSIZE, &nrun);
+      breadv(ip->dev, addr, bv, nrun);
+      i = 0;
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+    memmove(dst, bv[i]->data + off%BSIZE, m);
+    brelse(bv[i++]);
   }
+  readahead(ip, start/BSIZE, (start + n - 1)/BSIZE);
   return n;
 }
 
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
+// ファイルのデータはログに書かず、キャッシュに留めてトランザクションの
+// コミット前にまとめて書き戻す(ordered mode, log.cを参照)。
+// ディレクトリの内容はメタデータなのでログに書く。
+// ブロック全体を書き換えるときはディスクから古い内容を読まない。
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr, nrun;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -514,14 +741,27 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(n > 0 && (off + n - 1)/BSIZE >= MAXFILE)
     return -1;
 
+  // 既存の連続したブロックに書く間はブロックの対応付けを引き直さない
+  addr = nrun = 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if(nrun == 0){
+      nrun = (off + n - tot - 1)/BSIZE - off/BSIZE + 1;
+      addr = bmap(ip, off/BSIZE, &nrun);
+    }
     m = min(n - tot, BSIZE - off%BSIZE);
+    if(m == BSIZE)
+      bp = bnew(ip->dev, addr++);
+    else
+      bp = bread(ip->dev, addr++);
+    nrun--;
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(ip->type == T_DIR)
+      log_write(bp);
+    else
+      log_ordered(bp);
     brelse(bp);
   }
 
@@ -541,39 +781,214 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// 名前のハッシュ値(FNV-1a)。ディレクトリ内のバケットを決める
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261u;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// nb個のバケットを持つディレクトリでハッシュ値hのエントリが入るバケット
+// (fs.hの線形ハッシュ法の説明を参照)
+static uint
+dirbucket(uint h, uint nb)
+{
+  uint m, b;
+
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  b = h & (m-1);
+  if(b < nb - m)
+    b = h & (2*m-1);
+  return b;
+}
+
+// ディレクトリの末尾にバケットを1つ加え、そのブロックアドレスを返す。
+// balloc()がブロックを0で埋めるので、新しいバケットは空になる
+static uint
+dirgrow(struct inode *dp)
+{
+  uint addr, n;
+
+  n = 1;
+  addr = bmap(dp, dp->size / BSIZE, &n);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return addr;
+}
+
+// バケットを1つ増やし、分割するバケットからエントリの一部を移す。
+// 書き込むのは分割するバケット、新しいバケット、ビットマップ、
+// 間接ブロックとinodeの高々5ブロック
+static void
+dirsplit(struct inode *dp)
+{
+  uint nb, m, s, a, b, i, j;
+  struct buf *bp, *bq;
+  struct dirent *src, *dst;
+
+  nb = dp->size / BSIZE;
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  s = nb - m;
+  b = dirgrow(dp);
+  i = 1;
+  a = bmap(dp, s, &i);
+  // バッファはブロック番号の昇順にロックする
+  if(a < b){
+    bp = bread(dp->dev, a);
+    bq = bread(dp->dev, b);
+  } else {
+    bq = bread(dp->dev, b);
+    bp = bread(dp->dev, a);
+  }
+  src = (struct dirent*)bp->data;
+  dst = (struct dirent*)bq->data;
+  for(i = j = 0; i < DPB; i++){
+    if(src[i].inum == 0 || dirbucket(dirhash(src[i].name), nb+1) != nb)
+      continue;
+    dst[j] = src[i];
+    memset(&src[i], 0, sizeof(src[i]));
+    // 移ったエントリのオフセットが変わるのでdcacheも直す
+    dcacheenter(dp->dev, dp->inum, dst[j].name, dst[j].inum,
+                nb*BSIZE + j*sizeof(*dst));
+    j++;
+  }
+  log_write(bp);
+  log_write(bq);
+  brelse(bp);
+  brelse(bq);
+}
+
+// バケットbのブロックを読み、*poffにその先頭のオフセットを設定する
+static struct buf*
+dirbread(struct inode *dp, uint b, uint *poff)
+{
+  uint n;
+
+  n = 1;
+  *poff = b*BSIZE;
+  return bread(dp->dev, bmap(dp, b, &n));
+}
+
+// バケットbで使われているエントリの数を返し、*poffに最初の空きエントリの
+// オフセットを設定する。空きがなければ*poffはバケットの末尾になる
+static int
+dirused(struct inode *dp, uint b, uint *poff)
+{
+  uint off, i;
+  int used;
+  struct buf *bp;
+  struct dirent *de;
+
+  bp = dirbread(dp, b, &off);
+  de = (struct dirent*)bp->data;
+  *poff = off + BSIZE;
+  used = 0;
+  for(i = 0; i < DPB; i++){
+    if(de[i].inum != 0)
+      used++;
+    else if(*poff == off + BSIZE)
+      *poff = off + i*sizeof(*de);
+  }
+  brelse(bp);
+  return used;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// dpは読み手としてロックしていればよい。ディレクトリには割り当てられていない
+// ブロックがないので、readi()がinodeを書き換えることはない
+// 結果はdcacheに覚えておき、次からはディレクトリを読まずに返す(dcache.cを参照)。
+// 探すのは名前のハッシュ値で決まる1つのバケットだけ。
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, i;
+  struct buf *bp;
+  struct dirent *de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlookup read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  if(dcachelookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(dp->size >= BSIZE){
+    bp = dirbread(dp, dirbucket(dirhash(name), dp->size / BSIZE), &off);
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DPB; i++, off += sizeof(*de)){
+      if(de[i].inum == 0)
+        continue;
+      if(namecmp(name, de[i].name) == 0){
+        // entry matches path element
+        if(poff)
+          *poff = off;
+        inum = de[i].inum;
+        brelse(bp);
+        dcacheenter(dp->dev, dp->inum, name, inum, off);
+        return iget(dp->dev, inum);
+      }
     }
+    brelse(bp);
   }
 
+  dcacheenter(dp->dev, dp->inum, name, 0, 0);
   return 0;
 }
 
+// ディレクトリdpのオフセット*poffから、使われているエントリをdstに
+// nバイト分まで写す。各ブロックは1度bread()するだけで、その中の
+// エントリをまとめて調べる。写したバイト数(struct direntの倍数)を返し、
+// *poffは調べ終えた位置まで進める。dpはロックしていること
+int
+dirread(struct inode *dp, char *dst, uint *poff, int n)
+{
+  uint off, i, nb;
+  int m;
+  struct buf *bp;
+  struct dirent *de;
+
+  if(dp->type != T_DIR)
+    panic("dirread not DIR");
+
+  m = 0;
+  off = *poff - *poff % sizeof(*de);
+  while(off < dp->size && m + (int)sizeof(*de) <= n){
+    nb = 1;
+    bp = bread(dp->dev, bmap(dp, off / BSIZE, &nb));
+    de = (struct dirent*)bp->data;
+    for(i = off % BSIZE / sizeof(*de); i < DPB && m + (int)sizeof(*de) <= n; i++){
+      off += sizeof(*de);
+      if(de[i].inum == 0)
+        continue;
+      memmove(dst + m, &de[i], sizeof(*de));
+      m += sizeof(*de);
+    }
+    brelse(bp);
+  }
+  *poff = off;
+  return m;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
+// エントリは名前のバケットに置き、バケットが混んでいれば先に1つ分割する。
+// 分割しても入るバケットに空きがなければ-1を返す
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  uint off, h, b;
   struct dirent de;
   struct inode *ip;
 
@@ -584,17 +999,20 @@ dirlink(struct inode *dp, char *name, uint inum)
   }
 
   // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
-  }
+  h = dirhash(name);
+  if(dp->size < BSIZE)
+    dirgrow(dp);
+  else if(dirused(dp, dirbucket(h, dp->size / BSIZE), &off) >= DIRSPLIT)
+    dirsplit(dp);
+  b = dirbucket(h, dp->size / BSIZE);
+  if(dirused(dp, b, &off) == DPB)
+    return -1;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcacheenter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -651,22 +1069,25 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd); // 参照カウンタをインクリメントするだけ
 
 
+  // 途中のディレクトリは読むだけなので読み手としてロックし、
+  // 同じディレクトリを通る他の検索と並行して進めるようにする
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
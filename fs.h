@@ -3,7 +3,7 @@
 
 
 #define ROOTINO 1  // ルートディレクトリのinode番号
-#define BSIZE 512  // ブロックのサイズ
+#define BSIZE 4096  // ブロックのサイズ(ページサイズと同じ)
 
 // ディスクのレイアウト:
 // [ブートブロック | スーパーブロック | ログ | inodeブロック | フリービットマップ | データブロック]
@@ -14,15 +14,24 @@ struct superblock {
   uint size;         // システムイメージのサイズ(ブロック数)
   uint nblocks;      // データブロックの数
   uint ninodes;      // inodeの数.
-  uint nlog;         // ログブロックの数
+  uint nlog;         // ログブロックの数(ヘッダを除く)
   uint logstart;     // 初期ログブロックの数
   uint inodestart;   // 初期inodeブロックの数
   uint bmapstart;    // 初期フリーマップブロックの数
+  uint nloghead;     // ログヘッダのブロック数(ログの先頭logstartから)
 };
 
-#define NDIRECT 12 // Not DIRECT
-#define NINDIRECT (BSIZE / sizeof(uint)) // Not IN-DIRECT (16)
-#define MAXFILE (NDIRECT + NINDIRECT) // 28
+// ログヘッダはlogstartから連続するnlogheadブロックに、ログされたブロック数n、
+// nとブロック番号のチェックサム、ブロック番号を順にuintで並べたもの。
+// 1ブロックに収まらない分は後続のブロックに続く。
+#define LPB           (BSIZE / sizeof(uint))  // ログヘッダ1ブロックあたりのエントリ数
+#define LOGHDR        2                       // ブロック番号の前に置くエントリ数(nとチェックサム)
+#define LOGHEAD(n)    (((n) + LOGHDR + LPB - 1) / LPB) // n個のブロック番号を記録するヘッダのブロック数
+
+#define NDIRECT 11 // Not DIRECT
+#define NINDIRECT (BSIZE / sizeof(uint)) // Not IN-DIRECT (1024)
+#define NDINDIRECT (NINDIRECT * NINDIRECT) // 二重間接ブロックから辿れるブロック数(1M)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT) // 1049611(ただしサイズはuintで4GB未満)
 
 // ディスク上のinodeの構造体
 struct dinode {
@@ -31,7 +40,7 @@ struct dinode {
   short minor;          // デバイスのマイナー番号(T_DEV only)
   short nlink;          // ファイルシステム内のinodeのリンク数
   uint size;            // ファイルサイズ(バイト)
-  uint addrs[NDIRECT+1];   // データブロックアドレスのリスト
+  uint addrs[NDIRECT+2];   // データブロックアドレスのリスト(直接, 間接, 二重間接)
 };
 
 // ブロック毎のinodeの数(Inode Per Block)
@@ -55,3 +64,13 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// ディレクトリの各ブロックは線形ハッシュ法のバケットで、エントリは
+// 名前のハッシュ値(DIRSIZ文字までのFNV-1a)から決まるバケットに置く。
+// バケット数nbはsize/BSIZEで、2^L <= nb < 2^(L+1)のときハッシュ値hの
+// バケットはh mod 2^L、それがnb - 2^Lより小さければh mod 2^(L+1)。
+// バケットを増やすときはnb - 2^L番のバケットを分割し、nb番へ移るエントリを
+// 新しいブロックに移す。1ブロックのディレクトリは全てのエントリが
+// 同じバケットに入るので、小さいディレクトリは従来通りの線形な形になる。
+#define DPB      (BSIZE / sizeof(struct dirent))  // バケットあたりのエントリ数
+#define DIRSPLIT (DPB * 3 / 4)  // これ以上使われているバケットに加えるときは分割する
+
@@ -0,0 +1,2 @@
+#define FUTEX_WAIT 0  // ワードの値が期待値と等しければ眠る
+#define FUTEX_WAKE 1  // ワードで眠っているプロセスを指定した数だけ起こす
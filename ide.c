@@ -1,4 +1,6 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.
+// PCIのバスマスタIDEコントローラ(QEMUが模倣するPIIX)が見つかれば
+// DMAで転送し、見つからなければPIOで転送する。
 
 #include "types.h"
 #include "defs.h"
@@ -25,17 +27,63 @@
 #define IDE_CMD_WRITE 0x30 // 書き込み
 #define IDE_CMD_RDMUL 0xc4 // 読み込み(複数)
 #define IDE_CMD_WRMUL 0xc5 // 書き込み(複数)
+#define IDE_CMD_SETMUL 0xc6 // 1回の割り込みで転送するセクタ数を設定
+#define IDE_CMD_RDDMA 0xc8 // DMAで読み込み
+#define IDE_CMD_WRDMA 0xca // DMAで書き込み
+
+// 1つのコマンドで転送するセクタ数の上限。
+// 複数セクタのPIOコマンドにはREAD/WRITE MULTIPLEを使うため
+// 起動時にSET MULTIPLEでこの値を設定しておく(QEMUは16まで)。
+// 隣接するブロックへの要求はこの上限までまとめて1つのコマンドにする。
+#define IDE_MULT      16
+
+// DMAの1つのコマンドで転送するセクタ数の上限(セクタ数レジスタは8bit)
+#define IDE_DMAMAX    128
+
+// バスマスタIDEのレジスタ(PCIのBAR4からのオフセット, プライマリチャネル)
+#define BM_CMD        0    // コマンド
+  #define BM_START      0x01 // 転送開始
+  #define BM_READ       0x08 // デバイスからメモリへの転送
+#define BM_STATUS     2    // ステータス(1を書き込むとクリア)
+  #define BM_ERR        0x02 // エラー
+  #define BM_INTR       0x04 // 割り込み発生
+#define BM_PRDT       4    // PRDテーブルの物理アドレス
+
+// PRD(Physical Region Descriptor)
+// DMAで転送する物理メモリの領域。64KB境界をまたいではならない。
+struct prd {
+  uint addr;     // 物理アドレス
+  ushort count;  // バイト数(0は64KB)
+  ushort flags;  // PRD_EOT: テーブルの最後のエントリ
+};
+#define PRD_EOT       0x8000
+#define NPRD          (IDE_DMAMAX*SECTOR_SIZE/BSIZE) // バッファ1つにつき1つ
+
+// PCIコンフィギュレーション空間へのアクセスポート
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
 // You must hold idelock while manipulating queue.
+//
+// 先頭のidecount個のバッファが実行中のコマンドで転送されている。
+// 残りの待機中の要求はエレベータ(C-LOOK)順に並べる:
+// ヘッドの位置(idepos)以降のブロックを昇順に並べ、その後ろに
+// ヘッドより手前のブロックを昇順に並べる(次の周回で処理する)。
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idecount;  // 実行中のコマンドが転送しているバッファの数(0なら停止中)
+static uint idepos;   // 最後に開始したコマンドの末尾のブロック番号
 
 static int havedisk1;
 static void idestart(struct buf*);
 
+static ushort bmbase; // バスマスタIDEのI/Oポート(0ならDMAを使わない)
+// テーブル全体が64KB境界をまたがないようにサイズ分でアラインメントする
+static struct prd prdt[NPRD] __attribute__((aligned(NPRD*sizeof(struct prd))));
+
 // IDEディスクが準備完了になるまで待機
 static int
 idewait(int checkerr)
@@ -53,6 +101,77 @@ idewait(int checkerr)
   return 0;
 }
 
+// PCIコンフィギュレーション空間のバス0, デバイスdev, ファンクションfnの
+// offの位置の4バイトを読み込む
+static uint
+pciread(int dev, int fn, int off)
+{
+  outl(PCI_CONFIG_ADDR, 0x80000000 | (dev<<11) | (fn<<8) | (off & 0xfc));
+  return inl(PCI_CONFIG_DATA);
+}
+
+static void
+pciwrite(int dev, int fn, int off, uint v)
+{
+  outl(PCI_CONFIG_ADDR, 0x80000000 | (dev<<11) | (fn<<8) | (off & 0xfc));
+  outl(PCI_CONFIG_DATA, v);
+}
+
+// PCIバス0からバスマスタ機能を持つIDEコントローラを探し
+// バスマスタのI/Oポートを返す。見つからなければ0を返す。
+static ushort
+idepci(void)
+{
+  int dev, fn;
+  uint class, bar;
+
+  for(dev = 0; dev < 32; dev++){
+    for(fn = 0; fn < 8; fn++){
+      if((pciread(dev, fn, 0x00) & 0xffff) == 0xffff) // 存在しない
+        continue;
+      class = pciread(dev, fn, 0x08);
+      // クラス0x01(大容量記憶装置), サブクラス0x01(IDE), バスマスタ対応(ProgIF bit7)
+      if((class >> 16) != 0x0101 || (class & 0x8000) == 0)
+        continue;
+      bar = pciread(dev, fn, 0x20); // BAR4
+      if((bar & 1) == 0 || (bar & ~3) == 0) // I/O空間でない
+        continue;
+      // I/O空間へのアクセスとバスマスタを有効にする
+      pciwrite(dev, fn, 0x04, pciread(dev, fn, 0x04) | 0x05);
+      return bar & 0xfffc;
+    }
+  }
+  return 0;
+}
+
+// driveのREAD/WRITE MULTIPLEの1回の割り込みで転送するセクタ数を設定する
+static void
+idesetmult(int drive, int n)
+{
+  idewait(0);
+  outb(0x1f6, 0xe0 | (drive<<4));
+  outb(0x1f2, n);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  idewait(0);
+}
+
+// bから続くnbuf個のバッファのデータをPRDテーブルに設定する。
+// バッファのデータはページにアラインされているため64KB境界をまたがない。
+static void
+prdfill(struct buf *b, int nbuf)
+{
+  int i;
+
+  if(nbuf > NPRD)
+    panic("prdfill");
+  for(i = 0; i < nbuf; i++, b = b->qnext){
+    prdt[i].addr = V2P(b->data);
+    prdt[i].count = BSIZE;
+    prdt[i].flags = 0;
+  }
+  prdt[i-1].flags = PRD_EOT;
+}
+
 // IDE用のロック変数の初期化及びSlaveドライブの存在を確認
 void
 ideinit(void)
@@ -81,13 +200,27 @@ ideinit(void)
 
   // Masterのドライブに値を戻す
   outb(0x1f6, 0xe0 | (0<<4));
+
+  // 複数セクタのPIO転送のためにREAD/WRITE MULTIPLEの単位を設定する
+  idesetmult(0, IDE_MULT);
+  if(havedisk1)
+    idesetmult(1, IDE_MULT);
+
+  bmbase = idepci();
+  if(bmbase)
+    cprintf("ide: bus master DMA at 0x%x\n", bmbase);
 }
 
 // バッファのためのリクエストを開始する。
+// bに続いて同じデバイス・同じ方向で連続するブロックへの要求がキューにあれば
+// PIOではIDE_MULT、DMAではIDE_DMAMAXセクタまでまとめて1つのコマンドで転送する。
 // 呼び出し側はideのロックを取得しておく必要がある
 static void
 idestart(struct buf *b)
 {
+  struct buf *p;
+  int n, max;
+
   // バッファキャッシュの指定なし
   if(b == 0)
     panic("idestart");
@@ -97,28 +230,54 @@ idestart(struct buf *b)
     panic("incorrect blockno");
   
   // 単一ブロック内のセクタ数の算出及びセクタ番号の算出
-  int sector_per_block =  BSIZE/SECTOR_SIZE; // ブロック内のセクタ数(== 1)
+  int sector_per_block =  BSIZE/SECTOR_SIZE; // ブロック内のセクタ数(== 8)
   int sector = b->blockno * sector_per_block; // ブロック番号から読み出すセクタの位置を算出
 
-  // セクタサイズとブロックサイズが同じ場合には単一の読み込み
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  // セクタ数が多すぎる(PIOでは1回の割り込みで転送できる分まで)
+  if (sector_per_block > IDE_MULT) panic("idestart");
 
-  // セクタ数が多すぎる
-  if (sector_per_block > 7) panic("idestart");
+  // 後続の隣接する要求をまとめる
+  max = bmbase ? IDE_DMAMAX : IDE_MULT;
+  for(n = 1, p = b; p->qnext && (n+1)*sector_per_block <= max; n++, p = p->qnext){
+    if(p->qnext->dev != b->dev || p->qnext->blockno != p->blockno + 1 ||
+       (p->qnext->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+  }
+  idecount = n;
+  idepos = p->blockno;
+
+  // 1セクタだけの場合には単一の読み込み
+  int nsector = n * sector_per_block;
+  int read_cmd = (nsector == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
+  int write_cmd = (nsector == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+
+  // DMAであれば転送元・転送先のメモリを設定してDMAコマンドを使う
+  if(bmbase){
+    read_cmd = IDE_CMD_RDDMA;
+    write_cmd = IDE_CMD_WRDMA;
+  }
 
   idewait(0); // ディスクが準備完了状態になるまで待機
   // https://wiki.osdev.org/ATA_PIO_Mode
   outb(0x3f6, 0);  // 一般的な割り込み
-  outb(0x1f2, sector_per_block);  // セクタ数
+  outb(0x1f2, nsector);  // セクタ数
   outb(0x1f3, sector & 0xff); // LBAの下位8bit
   outb(0x1f4, (sector >> 8) & 0xff); // LBAの9~16bit
   outb(0x1f5, (sector >> 16) & 0xff); // LBAの17~24bit
   // master == 0xE0, slave == 0xF0
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f)); // LBAの上位4bit(25~28)及び
-  if(b->flags & B_DIRTY){ // バッファの書き込みが必要である場合
+  if(bmbase){
+    prdfill(b, n);
+    outl(bmbase + BM_PRDT, V2P(prdt)); // PRDテーブルの物理アドレス
+    outb(bmbase + BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_READ); // 転送方向
+    outb(bmbase + BM_STATUS, BM_ERR | BM_INTR); // 前回のステータスをクリア
+    outb(0x1f7, (b->flags & B_DIRTY) ? write_cmd : read_cmd);
+    __sync_synchronize(); // PRDテーブルの内容を書き終えてから開始する
+    outb(bmbase + BM_CMD, inb(bmbase + BM_CMD) | BM_START); // 転送開始
+  } else if(b->flags & B_DIRTY){ // バッファの書き込みが必要である場合
     outb(0x1f7, write_cmd); // 書き込みコマンドを設定
-    outsl(0x1f0, b->data, BSIZE/4); // 実際に書き込み(一度に4バイト送信するためブロックサイズを4で除算する)
+    for(p = b; n > 0; n--, p = p->qnext)
+      outsl(0x1f0, p->data, BSIZE/4); // 実際に書き込み(一度に4バイト送信するためブロックサイズを4で除算する)
   } else {
     outb(0x1f7, read_cmd); // 読み込み
   }
@@ -130,23 +289,44 @@ ideintr(void)
 {
   struct buf *b;
 
-  // First queued buffer is the active request.
+  int n, ok;
+
+  // First queued buffers are the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if((b = idequeue) == 0 || idecount == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
-
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  ok = 1;
+  if(bmbase){
+    // DMAを停止し、バスマスタとディスクの割り込み状態をクリアする。
+    // データは既にb->dataに転送されている。
+    outb(bmbase + BM_CMD, 0);
+    outb(bmbase + BM_STATUS, BM_ERR | BM_INTR);
+    idewait(0);
+  } else if(!(b->flags & B_DIRTY))
+    ok = idewait(1) >= 0;
+
+  for(n = idecount; n > 0; n--){
+    b = idequeue;
+    idequeue = b->qnext;
+
+    // Read data if needed.
+    if(!bmbase && !(b->flags & B_DIRTY) && ok)
+      insl(0x1f0, b->data, BSIZE/4);
+
+    // Wake process waiting for this buf.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    wakeup(b);
+    if(b->flags & B_ASYNC){ // 先読みは誰も待っていないのでここで開放する
+      b->flags &= ~B_ASYNC;
+      bdone(b);
+    }
+  }
+  idecount = 0;
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
@@ -155,6 +335,57 @@ ideintr(void)
   release(&idelock);
 }
 
+// 待機中の要求にbをエレベータ順で挿入する。idelockを保持していること
+static void
+ideinsert(struct buf *b)
+{
+  struct buf **pp;
+  int i, key, k;
+
+  b->qnext = 0;
+  pp = &idequeue;
+  for(i = 0; i < idecount && *pp; i++) // 実行中のコマンドの分は飛ばす
+    pp = &(*pp)->qnext;
+
+  key = b->blockno > idepos ? 0 : 1; // 0: この周回, 1: 次の周回
+  for(; *pp; pp = &(*pp)->qnext){  //DOC:insert-queue
+    k = (*pp)->blockno > idepos ? 0 : 1;
+    if(k > key || (k == key && (*pp)->blockno > b->blockno))
+      break;
+  }
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// n個のバッファの読み込みをキューに入れ、完了を待たずに戻る(先読み用)。
+// バッファはロックしたまま渡し、転送が終わるとideintr()がbdone()で
+// ロックと参照を手放す。呼び出し元はその後バッファに触れてはならない
+void
+idereada(struct buf **bv, int n)
+{
+  struct buf *b;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b = bv[i];
+    if(!holdingsleep(&b->lock))
+      panic("idereada: buf not locked");
+    if(b->flags & (B_VALID|B_DIRTY))
+      panic("idereada: nothing to do");
+    if(b->dev != 0 && !havedisk1)
+      panic("idereada: ide disk 1 not present");
+  }
+
+  acquire(&idelock);
+  for(i = 0; i < n; i++){
+    bv[i]->flags |= B_ASYNC;
+    ideinsert(bv[i]);
+  }
+  if(idecount == 0 && idequeue)
+    idestart(idequeue);
+  release(&idelock);
+}
+
 //PAGEBREAK!
 // ディスクとバッファの内容を同期させる
 // B_DIRTYがセットされている場合はバッファをディスクに書き込み、B_DIRTYフラグ
@@ -163,36 +394,52 @@ ideintr(void)
 // をセットする
 void iderw(struct buf *b)
 {
-  struct buf **pp;
+  iderwv(&b, 1);
+}
 
-  // バッファのロックがされていない場合
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  
-  // バッファが有効である場合、何もする必要がない
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+// n個のバッファをまとめてキューに入れ、全ての転送が終わるまで待つ。
+// 一度にキューに入れるため、隣接するブロックは1つのコマンドにまとめられる。
+void
+iderwv(struct buf **bv, int n)
+{
+  struct buf *b;
+  int i;
+
+  if(n == 0)
+    return;
+
+  for(i = 0; i < n; i++){
+    b = bv[i];
+
+    // バッファのロックがされていない場合
+    if(!holdingsleep(&b->lock))
+      panic("iderw: buf not locked");
 
-  // disk1を保持していない場合
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+    // バッファが有効である場合、何もする必要がない
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+
+    // disk1を保持していない場合
+    if(b->dev != 0 && !havedisk1)
+      panic("iderw: ide disk 1 not present");
+  }
 
   // ディスクのロックを行う
   acquire(&idelock);  //DOC:acquire-lock
 
-  b->qnext = 0;
-  // リストの末尾へ移動
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b; // バッファキャッシュをideキューの最後尾へ
+  for(i = 0; i < n; i++)
+    ideinsert(bv[i]);
 
   // 必要であればディスクを起動する
-  if(idequeue == b) // バッファキャッシュがideキューの先頭要素だった場合
-    idestart(b);
+  if(idecount == 0 && idequeue)
+    idestart(idequeue);
 
   // リスクエストが完了するまで待機
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){ // バッファが有効になるまで待機
-    sleep(b, &idelock); // 待機
+  for(i = 0; i < n; i++){
+    b = bv[i];
+    while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){ // バッファが有効になるまで待機
+      sleep(b, &idelock); // 待機
+    }
   }
 
   release(&idelock); // IDEのロックを開放
@@ -8,6 +8,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "proc.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
@@ -18,13 +19,30 @@ struct run {
   struct run *next;
 };
 
+// CPU毎の空きページリスト
+// kalloc()/kfree()は通常カレントCPUのリストだけを操作するため
+// CPU間でロックを奪い合うことがない。
+struct kmemcpu {
+  struct spinlock lock; // このリストを保護するロック
+  struct run *freelist; // 単方向リスト
+  int nfree; // リスト上の空きページ数
+};
+
 // 排他制御用の構造体
 struct {
-  struct spinlock lock; // ロック変数
   int use_lock; // ロックを使用する必要があるのか
-  struct run *freelist; // 単方向リスト
+  struct kmemcpu cpu[NCPU]; // CPU毎の空きページリスト
 } kmem;
 
+// 自CPUのリストが空になった時に他CPUのリストから一度に移すページ数の上限
+#define KSTEAL 64
+
+// 物理ページ毎の参照カウント。copy-on-writeで複数のページテーブルから
+// 共有されているページは、最後の参照がkfree()された時に初めて解放される。
+// 各CPUのリストのロックとは無関係に更新されるためアトミック命令で操作する。
+static ushort kref[PHYSTOP/PGSIZE];
+#define KREF(v) (&kref[V2P(v)/PGSIZE])
+
 // 初期化は二段階で行われる。
 // 1) freelist上のentrypgdirによってマッピングされたページを配置するために
 // entrypgdirを使用しながらmain()がkinit1()を呼び出す。
@@ -33,7 +51,10 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
-  initlock(&kmem.lock, "kmem"); // kmemという名前でspinlock構造体を初期化
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem"); // kmemという名前でspinlock構造体を初期化
   kmem.use_lock = 0; // ロックを使用するかどうか(しない)
   freerange(vstart, vend); // アドレスで指定したメモリの範囲を初期化する
 }
@@ -46,41 +67,162 @@ kinit2(void *vstart, void *vend)
   kmem.use_lock = 1;
 }
 
+// ページvをCPU番号idの空きリストに繋ぐ
+static void
+kfreecpu(char *v, int id)
+{
+  struct run *r; // 単方向リスト
+  struct kmemcpu *k = &kmem.cpu[id];
+
+  // ページサイズ境界でアラインメントされていない || endよりも小さいアドレス || 許容されている物理メモリよりも大きい場合
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kfree");
+
+  // vを始点にページサイズ分を1で初期化する
+  memset(v, 1, PGSIZE);
+
+  if(kmem.use_lock) // ロックを使用する必要がある場合
+    acquire(&k->lock); // ロックを取得するまでスピンロック
+
+  // 空きメモリリストを初期化
+  r = (struct run*)v;
+  r->next = k->freelist;
+  k->freelist = r;
+  k->nfree++;
+
+  if(kmem.use_lock) // ロックを使用する必要がある場合
+    release(&k->lock); // ロックを開放
+}
+
 // vstartからvendまでのメモリを開放する
+// ページは起動済みのCPUのリストへ順番に振り分ける。
+// kinit1()の時点ではまだCPUを検出していない(ncpu == 0)ため全てCPU0のリストに入る。
 void
 freerange(void *vstart, void *vend)
 {
   char *p;
+  int n, i;
+
+  n = ncpu > 0 ? ncpu : 1;
+  i = 0;
   p = (char*)PGROUNDUP((uint)vstart); // ページサイズ以上にならないようにアドレス値を丸める
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE) // 指定された終点アドレスまでページサイズ単位で処理を繰り返す
-    kfree(p); // アドレスで指定したページを初期化する
+    kfreecpu(p, i++ % n); // アドレスで指定したページを初期化する
 }
 
-// vで参照する物理アドレスで指定されたページを解放する。
+// 現在のCPU番号。ロックを使用しない起動時はmycpu()がまだ使えないため0とする。
+static int
+kcpuid(void)
+{
+  int id;
+
+  if(!kmem.use_lock)
+    return 0;
+  pushcli();
+  id = cpuid();
+  popcli();
+  return id;
+}
+
+// 全CPUのリストにある空きページ数を返す
+int
+kfreepages(void)
+{
+  int i, n;
+
+  n = 0;
+  for(i = 0; i < NCPU; i++){
+    if(kmem.use_lock)
+      acquire(&kmem.cpu[i].lock);
+    n += kmem.cpu[i].nfree;
+    if(kmem.use_lock)
+      release(&kmem.cpu[i].lock);
+  }
+  return n;
+}
+
+// vで参照する物理アドレスで指定されたページの参照を1つ落とし、
+// 参照がなくなればページを解放する。
 // 通常はkalloc()の呼び出しにリターンするはずである。
 // 例外としてアロケータの起動がある。
 void
 kfree(char *v)
 {
-  struct run *r; // 単方向リスト
-
-  // ページサイズ境界でアラインメントされていない || endよりも小さいアドレス || 許容されている物理メモリよりも大きい場合
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
-  // vを始点にページサイズ分を1で初期化する
-  memset(v, 1, PGSIZE);
+  switch(__sync_fetch_and_sub(KREF(v), 1)){
+  case 0:
+    panic("kfree: not allocated");
+  case 1:
+    kfreecpu(v, kcpuid()); // 最後の参照なのでカレントCPUのリストに返す
+    break;
+  }
+}
 
-  if(kmem.use_lock) // ロックを使用する必要がある場合
-    acquire(&kmem.lock); // ロックを取得するまでスピンロック
-  
-  // 空きメモリリストを初期化  
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+// vで参照するページの参照カウントを増やす(ページを共有する)
+void
+kdup(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kdup");
+  __sync_fetch_and_add(KREF(v), 1);
+}
 
-  if(kmem.use_lock) // ロックを使用する必要がある場合
-    release(&kmem.lock); // ロックを開放
+// vで参照するページの参照カウントを返す
+int
+krefcnt(char *v)
+{
+  return *KREF(v);
+}
+
+// CPU番号idのリストが空の時、他のCPUのリストから最大KSTEALページを
+// まとめて移し、そのうち1ページを返す。どこにも空きがなければ0を返す。
+// 2つのリストのロックを同時に保持しないように、切り出しと繋ぎ込みは別々に行う。
+static struct run*
+ksteal(int id)
+{
+  struct kmemcpu *k, *v;
+  struct run *r, *head, *tail;
+  int i, j, n;
+
+  for(i = 1; i < NCPU; i++){
+    v = &kmem.cpu[(id + i) % NCPU];
+    if(v->freelist == 0) // ロックを取らずに覗いて空のリストは飛ばす
+      continue;
+
+    acquire(&v->lock);
+    // 持っている空きページの半分(最低1, 最大KSTEAL)を先頭から切り出す
+    n = v->nfree / 2;
+    if(n < 1)
+      n = 1;
+    if(n > KSTEAL)
+      n = KSTEAL;
+    head = tail = v->freelist;
+    if(head == 0){
+      release(&v->lock);
+      continue;
+    }
+    for(j = 1; j < n && tail->next; j++)
+      tail = tail->next;
+    v->freelist = tail->next;
+    v->nfree -= j;
+    release(&v->lock);
+
+    // 1ページは呼び出し元に返し、残りを自分のリストに繋ぐ
+    r = head;
+    head = head->next;
+    if(head){
+      k = &kmem.cpu[id];
+      acquire(&k->lock);
+      tail->next = k->freelist;
+      k->freelist = head;
+      k->nfree += j - 1;
+      release(&k->lock);
+    }
+    return r;
+  }
+  return 0;
 }
 
 // 4KBの物理メモリページフレームを割り当てる。
@@ -90,19 +232,31 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kmemcpu *k;
+  int id;
+
+  id = kcpuid();
+  k = &kmem.cpu[id];
 
   /* ロックを使用する必要がある場合にはロックを取得する */
   if(kmem.use_lock)
-    acquire(&kmem.lock);
-  
-  r = kmem.freelist; // フリーリストを取得
-  if(r) // フリーリストが存在する
-    kmem.freelist = r->next; // フリーリストに次の要素を設定(先頭を使用するため)
-  
+    acquire(&k->lock);
+
+  r = k->freelist; // フリーリストを取得
+  if(r){ // フリーリストが存在する
+    k->freelist = r->next; // フリーリストに次の要素を設定(先頭を使用するため)
+    k->nfree--;
+  }
+
   /* ロックを使用する必要がある場合にはロックを開放する */
   if(kmem.use_lock)
-    release(&kmem.lock);
-  
+    release(&k->lock);
+
+  // 自CPUのリストが空であれば他のCPUから補充する
+  if(r == 0 && kmem.use_lock)
+    r = ksteal(id);
+
+  if(r)
+    *KREF(r) = 1;
   return (char*)r; // フリーリストの先頭要素をかえす
 }
-
@@ -52,6 +52,11 @@ lapicw(int index, int value)
   lapic[ID];  // 読み込むことで書き込み完了を待つ
 }
 
+// 1tick分のタイマのカウント(バスの周波数で数える)
+#define TICKCOUNT  10000000
+// ワンショットで数えられる最大のtick数(TICRは32ビット)
+#define MAXONESHOT (0xffffffff / TICKCOUNT)
+
 // APICのセットアップ
 void
 lapicinit(void)
@@ -67,7 +72,7 @@ lapicinit(void)
   // もしxv6がより正確な時間管理を行う場合には外部タイマソースを用いて調整する。
   lapicw(TDCR, X1); // カウンタを1で割る
   lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  lapicw(TICR, 10000000); // 初期値を設定
+  lapicw(TICR, TICKCOUNT); // 初期値を設定
 
   // 論理割り込みラインを無効に
   lapicw(LINT0, MASKED);
@@ -115,6 +120,65 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// apicidのCPUにvectorのプロセッサ間割り込み(IPI)を送る
+void
+lapicipi(int apicid, int vector)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// CPUごとの、まだtickとして数えていない1tick未満の経過時間(タイマのカウント)。
+// ワンショットに切り替える時点の定期割り込みの途中の分と、定期割り込みに
+// 戻す時の端数をためておき、次の切り替えで数える
+static uint subtick[NCPU];
+
+// 停止するCPUのタイマを、n tick後に1回だけ割り込むワンショットに切り替える。
+// 期限は数えていない端数の分だけ早め、tickの境界で割り込むようにする。
+// nが0ならタイマを止める。nが大きすぎる場合は数えられる最大で割り込む
+void
+lapiconeshot(uint n)
+{
+  uint *acc, t;
+
+  if(!lapic)
+    return;
+  acc = &subtick[cpuid()];
+  *acc += TICKCOUNT - lapic[TCCR]; // 定期割り込みの今のtickで経過した分
+  if(n == 0){
+    lapicw(TIMER, MASKED | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, 0);
+    return;
+  }
+  if(n > MAXONESHOT)
+    n = MAXONESHOT;
+  t = n * TICKCOUNT;
+  lapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  lapicw(TICR, t > *acc ? t - *acc : 1);
+}
+
+// タイマを定期的な割り込みに戻し、lapiconeshot()の前から数えていない分を
+// 含めて経過したtick数を返す。1tickに満たない端数は次に持ち越す
+uint
+lapicperiodic(void)
+{
+  uint *acc, init, cur, n;
+
+  if(!lapic)
+    return 0;
+  acc = &subtick[cpuid()];
+  init = lapic[TICR];
+  cur = lapic[TCCR];
+  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, TICKCOUNT);
+  *acc += init - cur;
+  n = *acc / TICKCOUNT;
+  *acc %= TICKCOUNT;
+  return n;
+}
+
 // 指定音マイクロ秒スピンする
 // 物理機器では動的に調節される
 void
@@ -18,180 +18,374 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the log writer has committed.
+//
+// コミットはカーネルプロセス(logwriter)が行う。end_op()は
+// コミットを待たずに戻るため、システムコールを続けて発行する
+// プロセスの更新は1つのトランザクションにまとめられる(group commit)。
+// 更新がディスクに反映されるまで待つ必要がある場合はlog_sync()
+// (fsyncシステムコール)を呼ぶ。
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   header blocks, containing block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// ログの大きさはmkfsが決めてスーパーブロックに記録する。
+// ヘッダは複数ブロックにまたがることがある(fs.hのLOGHEADを参照)。
+//
+// ログに書くのはメタデータだけで、ファイルのデータはlog_ordered()で
+// トランザクションに記録しておき、コミットの前にホームの位置へ直接
+// 書き込む(ordered mode)。データはログの容量を使わないので、大きな書き込みも
+// 少数のトランザクションで済み、書き戻しは連続したブロックにまとめられる。
+// データがメタデータより先にディスクに届くため、クラッシュしても
+// inodeが書かれていないブロックを指すことはない。
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// In-memory copy of the log header, used to keep track of
+// logged block# before commit.
 struct logheader {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
-  int start;
-  int size;
+  int start;       // ログヘッダの先頭ブロック
+  int nhead;       // ログヘッダのブロック数
+  int size;        // ログのデータブロック数
   int outstanding; // how many FS sys calls are executing.
+  int dataops;     // そのうちファイルのデータを書く(MAXOPDATAを予約した)操作の数
   int committing;  // in commit(), please wait.
+  int syncing;     // log_sync()で完了を待っているプロセスの数
+  uint opened;     // 現在開いている(コミット中を含む)トランザクションの番号
+  uint durable;    // ディスクへのコミットが完了した最後のトランザクションの番号
   int dev;
   struct logheader lh;
+  int ndata;             // コミット前に書き戻すデータブロックの数
+  int data[LOGDATA];     // そのブロック番号
+  // このトランザクションで解放したブロックのビットマップ。コミットまでは
+  // ディスク上のメタデータがまだ指しているので、balloc()は再利用しない
+  uchar freed[(FSSIZE+7)/8];
+  struct buf *bv[LOGMAX]; // write_log()/install_trans()/write_data()でまとめて書くバッファ
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logwriter(void);
 
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   struct superblock sb;
   initlock(&log.lock, "log");
   readsb(dev, &sb);
   log.start = sb.logstart;
+  log.nhead = sb.nloghead;
   log.size = sb.nlog;
   log.dev = dev;
+  if (log.size > LOGMAX || log.nhead < LOGHEAD(log.size))
+    panic("initlog: bad log size");
+  // コミット中はログされたブロックとログブロックの両方がキャッシュに留まる。
+  // 書き戻す前のデータブロックも留まる
+  if (nbuf < 2*log.size + MAXOPBLOCKS + LOGDATA)
+    panic("initlog: buffer cache too small for log");
+  if (LOGDATA > LOGMAX)
+    panic("initlog: LOGDATA");
+  log.opened = 1;
+  log.durable = 0;
   recover_from_log();
+  if(kproc("logwriter", logwriter) < 0)
+    panic("initlog: logwriter");
 }
 
 // Copy committed blocks from log to their home location
+// 書き込みはまとめて発行し、ドライバにブロック番号順に並べ替えさせる
 static void
 install_trans(void)
 {
   int tail;
+  struct buf **dbuf = log.bv;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
+    struct buf *lbuf = bread(log.dev, log.start+log.nhead+tail); // read log block
+    dbuf[tail] = bread(log.dev, log.lh.block[tail]); // read dst
+    memmove(dbuf[tail]->data, lbuf->data, BSIZE);  // copy block to dst
     brelse(lbuf);
-    brelse(dbuf);
   }
+  bwritev(dbuf, log.lh.n);  // write dst to disk
+  for (tail = 0; tail < log.lh.n; tail++)
+    brelse(dbuf[tail]);
+}
+
+// ヘッダのnとブロック番号のチェックサム(FNV-1a)
+static uint
+head_sum(struct logheader *lh)
+{
+  uint h = 2166136261;
+  int i;
+
+  h = (h ^ lh->n) * 16777619;
+  for (i = 0; i < lh->n; i++)
+    h = (h ^ lh->block[i]) * 16777619;
+  return h;
 }
 
 // Read the log header from disk into the in-memory log header
+// チェックサムが合わないヘッダは書き込みの途中で途切れたもので、
+// そのトランザクションはコミットされていないので空のログとして扱う
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
+  uint *hb = (uint *) (buf->data);
+  uint sum;
+  int i, j;
+  log.lh.n = hb[0];
+  sum = hb[1];
+  if (log.lh.n > log.size)
+    panic("read_head: bad log header");
   for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+    j = i + LOGHDR; // ヘッダ内のエントリ番号(0番はn、1番はチェックサム)
+    if (j % LPB == 0) { // 次のヘッダブロックへ
+      brelse(buf);
+      buf = bread(log.dev, log.start + j/LPB);
+      hb = (uint *) (buf->data);
+    }
+    log.lh.block[i] = hb[j % LPB];
   }
   brelse(buf);
+  if (sum != head_sum(&log.lh))
+    log.lh.n = 0;
 }
 
 // Write in-memory log header to disk.
 // This is the true point at which the
 // current transaction commits.
+// ヘッダは複数のセクタにまたがり、書き込みの途中でクラッシュすると一部の
+// セクタだけが新しくなりうる。nとチェックサムは1ブロック目の先頭(同じ
+// セクタ)に置き、read_head()はチェックサムが合うヘッダだけを採用する。
+// 2ブロック目以降を先に書き、1ブロック目を最後に書く。
 static void
 write_head(void)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
+  struct buf *buf, **bv = log.bv;
+  uint *hb;
+  int i, j, nb;
+
+  nb = LOGHEAD(log.lh.n);
+  for (i = 0; i < nb; i++) {
+    bv[i] = bread(log.dev, log.start + i);
+    memset(bv[i]->data, 0, BSIZE);
+  }
+  ((uint *) bv[0]->data)[0] = log.lh.n;
+  ((uint *) bv[0]->data)[1] = head_sum(&log.lh);
   for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+    j = i + LOGHDR;
+    hb = (uint *) bv[j/LPB]->data;
+    hb[j % LPB] = log.lh.block[i];
   }
+  buf = bv[0];
+  if (nb > 1)
+    bwritev(bv+1, nb-1);
   bwrite(buf);
-  brelse(buf);
+  for (i = 0; i < nb; i++)
+    brelse(bv[i]);
 }
 
 static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
+  if (log.lh.n > 0)
+    install_trans(); // if committed, copy from log to disk
   log.lh.n = 0;
   write_head(); // clear the log
 }
 
 // called at the start of each FS system call.
-void
-begin_op(void)
+// dataが真ならファイルのデータを書く操作で、ordered書き込みの枠も予約する
+static void
+beginop(int data)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.syncing){
+      // log_sync()の待ち手がいる間は新たな操作を始めず、
+      // 実行中の操作が抜けてコミットできるようにする
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.size ||
+              (data && log.ndata + (log.dataops+1)*MAXOPDATA > LOGDATA)){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.dataops += data;
       release(&log.lock);
       break;
     }
   }
 }
 
+void
+begin_op(void)
+{
+  beginop(0);
+}
+
+// ファイルのデータを書く操作(filewrite())の開始。end_opdata()で終える
+void
+begin_opdata(void)
+{
+  beginop(1);
+}
+
+void
+end_opdata(void)
+{
+  acquire(&log.lock);
+  log.dataops -= 1;
+  release(&log.lock);
+  end_op();
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation, lets the log
+// writer commit. does not wait for the commit.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+  if(log.outstanding == 0)
+    wakeup(&log.lh); // logwriterを起こす
+  // begin_op() may be waiting for log space,
+  // and decrementing log.outstanding has decreased
+  // the amount of reserved space.
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// 呼び出し時点までに終わった全ての操作がディスクにコミットされるまで待つ
+void
+log_sync(void)
+{
+  uint target;
+
+  acquire(&log.lock);
+  target = log.opened;
+  if(log.lh.n > 0 || log.ndata > 0 || log.committing){
+    log.syncing++;
+    while(log.durable < target){
+      wakeup(&log.lh);
+      sleep(&log, &log.lock);
+    }
+    log.syncing--;
     wakeup(&log);
   }
   release(&log.lock);
+}
+
+// ログのコミットを行うカーネルプロセス。
+// 実行中の操作がなくなり、ログに更新があればコミットする。
+// end_op()の呼び出し元はコミットのディスクI/Oを待たずに済み、
+// その間に始まった操作は次のトランザクションにまとめられる。
+static void
+logwriter(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    while(log.outstanding > 0 || (log.lh.n == 0 && log.ndata == 0))
+      sleep(&log.lh, &log.lock);
+    log.committing = 1;
+    release(&log.lock);
 
-  if(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
+
     acquire(&log.lock);
+    memset(log.freed, 0, sizeof(log.freed)); // 解放がディスクに届いた
     log.committing = 0;
+    log.durable = log.opened++;
     wakeup(&log);
-    release(&log.lock);
   }
 }
 
 // Copy modified blocks from cache to log.
+// ログのブロックは連続しているのでまとめて書けば少数のコマンドで済む
 static void
 write_log(void)
 {
   int tail;
+  struct buf **to = log.bv;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+    to[tail] = bread(log.dev, log.start+log.nhead+tail); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    memmove(to[tail]->data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
+  bwritev(to, log.lh.n);  // write the log
+  for (tail = 0; tail < log.lh.n; tail++)
+    brelse(to[tail]);
+}
+
+// ブロック番号を昇順に並べる。install_trans()やwrite_data()がバッファを
+// ブロック番号の昇順にロックするようにし、breadv()とのデッドロックを防ぐ。
+static void
+sort_blocks(int *block, int n)
+{
+  int i, j, b;
+
+  for (i = 1; i < n; i++) {
+    b = block[i];
+    for (j = i; j > 0 && block[j-1] > b; j--)
+      block[j] = block[j-1];
+    block[j] = b;
+  }
+}
+
+// このトランザクションで書かれたファイルのデータをホームの位置に書き込む。
+// ブロック番号順にまとめて渡すので、連続したブロックは1つのコマンドになる。
+// ログにも入っているブロック(解放されてメタデータに使われたもの)は
+// install_trans()に任せる
+static void
+write_data(void)
+{
+  int i, j, n;
+  struct buf *b, **bv = log.bv;
+
+  sort_blocks(log.data, log.ndata);
+  n = j = 0;
+  for (i = 0; i < log.ndata; i++) {
+    b = bread(log.dev, log.data[i]);
+    b->flags &= ~B_ORDERED;
+    while (j < log.lh.n && log.lh.block[j] < log.data[i])
+      j++;
+    if (j < log.lh.n && log.lh.block[j] == log.data[i])
+      brelse(b);
+    else
+      bv[n++] = b;
+  }
+  if (n > 0)
+    bwritev(bv, n);
+  for (i = 0; i < n; i++)
+    brelse(bv[i]);
+  log.ndata = 0;
 }
 
 static void
 commit()
 {
+  sort_blocks(log.lh.block, log.lh.n);
+  write_data();      // データをメタデータより先に書く
   if (log.lh.n > 0) {
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
@@ -215,7 +409,7 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -232,3 +426,50 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+// ブロックbを今のトランザクションで解放したことを記録する。bfree()から呼ばれる
+void
+log_free(uint b)
+{
+  if (b >= FSSIZE)
+    panic("log_free");
+  acquire(&log.lock);
+  log.freed[b/8] |= 1 << (b%8);
+  release(&log.lock);
+}
+
+// ブロックbがまだコミットされていないトランザクションで解放されたものか。
+// そのようなブロックを割り当てると、コミット前に書き戻したデータが
+// 解放前の持ち主のブロックを上書きしてしまう
+int
+log_freed(uint b)
+{
+  int r;
+
+  if (b >= FSSIZE)
+    return 0;
+  acquire(&log.lock);
+  r = (log.freed[b/8] >> (b%8)) & 1;
+  release(&log.lock);
+  return r;
+}
+
+// log_write()の代わりにファイルのデータを書いたバッファに使う。
+// ブロック番号をトランザクションに記録してキャッシュに留め、
+// コミットの前にwrite_data()が書き込む。ログには書かない。
+void
+log_ordered(struct buf *b)
+{
+  if (log.dataops < 1)
+    panic("log_ordered outside of trans");
+
+  acquire(&log.lock);
+  if ((b->flags & B_ORDERED) == 0) { // まだ記録していない
+    if (log.ndata >= LOGDATA)
+      panic("too many ordered blocks");
+    log.data[log.ndata++] = b->blockno;
+    b->flags |= B_ORDERED;
+  }
+  b->flags |= B_DIRTY; // prevent eviction
+  release(&log.lock);
+}
+
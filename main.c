@@ -29,11 +29,12 @@ main(void)
   uartinit();      // UARTの初期化
   pinit();         // プロセステーブル用のロックを初期化
   tvinit();        // 割り込み・トラップゲート及びtick割り込み用ロックの初期化
-  binit();         // バッファキャッシュの初期化
   fileinit();      // ファイルテーブル用ロックの初期化
+  dcacheinit();    // ディレクトリの名前のキャッシュの初期化
   ideinit();       // IDE用のロック変数及びSlaveドライブの存在確認
   startothers();   // 他のCPUを起動する
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // startothers()の後に呼び出す必要がある
+  binit();         // バッファキャッシュの初期化(空きメモリ量から大きさを決めるためkinit2()の後)
   userinit();      // 最初のユーザプロセス
   mpmain();        // finish this processor's setup
 }
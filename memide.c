@@ -58,3 +58,24 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(bv[i]);
+}
+
+// 先読み。メモリ上のディスクなので同期的に写し、すぐに開放する
+void
+idereada(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    iderw(bv[i]);
+    bdone(bv[i]);
+  }
+}
@@ -16,14 +16,16 @@
 #endif
 
 #define NINODES 200
+#define NLOG    (FSSIZE/10 < LOGMAX ? FSSIZE/10 : LOGMAX)  // ログのデータブロック数
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log header | log | inode blocks | free bit map | data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nlog = NLOG;
+int nloghead = LOGHEAD(NLOG);
+int nmeta;    // Number of meta blocks (boot, sb, log header, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
@@ -40,6 +42,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void dirappend(uint dinum, char *name, uint inum);
 
 // convert to intel byte order
 ushort
@@ -68,10 +71,8 @@ int
 main(int argc, char *argv[])
 {
   int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  uint rootino, inum;
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -83,6 +84,8 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(DPB * sizeof(struct dirent) == BSIZE);
+  assert(NLOG >= MAXOPBLOCKS*3 && NLOG <= LOGMAX);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -91,7 +94,7 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + nloghead + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
   sb.size = xint(FSSIZE);
@@ -99,11 +102,12 @@ main(int argc, char *argv[])
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.inodestart = xint(2+nloghead+nlog);
+  sb.bmapstart = xint(2+nloghead+nlog+ninodeblocks);
+  sb.nloghead = xint(nloghead);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log header blocks %u log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
+         nmeta, nloghead, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
@@ -117,15 +121,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirappend(rootino, ".", rootino);
+  dirappend(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     assert(index(argv[i], '/') == 0);
@@ -143,11 +140,7 @@ main(int argc, char *argv[])
       ++argv[i];
 
     inum = ialloc(T_FILE);
-
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirappend(rootino, argv[i], inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -155,13 +148,6 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
-
   balloc(freeblock);
 
   exit(0);
@@ -252,6 +238,47 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// 間接ブロックindのi番目のエントリを返す。なければ割り当てる
+uint
+indirect(uint ind, uint i)
+{
+  uint a[NINDIRECT];
+
+  rsect(ind, (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(freeblock++);
+    wsect(ind, (char*)a);
+  }
+  return xint(a[i]);
+}
+
+// inodeのfbn番目のブロックを返す。なければ割り当てる
+uint
+ibmap(struct dinode *din, uint fbn)
+{
+  uint x;
+
+  assert(fbn < MAXFILE);
+  if(fbn < NDIRECT){
+    if(xint(din->addrs[fbn]) == 0){
+      din->addrs[fbn] = xint(freeblock++);
+    }
+    x = xint(din->addrs[fbn]);
+  } else if(fbn < NDIRECT + NINDIRECT){
+    if(xint(din->addrs[NDIRECT]) == 0){
+      din->addrs[NDIRECT] = xint(freeblock++);
+    }
+    x = indirect(xint(din->addrs[NDIRECT]), fbn - NDIRECT);
+  } else {
+    if(xint(din->addrs[NDIRECT+1]) == 0){
+      din->addrs[NDIRECT+1] = xint(freeblock++);
+    }
+    x = indirect(xint(din->addrs[NDIRECT+1]), (fbn - NDIRECT - NINDIRECT) / NINDIRECT);
+    x = indirect(x, (fbn - NDIRECT - NINDIRECT) % NINDIRECT);
+  }
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +286,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,23 +293,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = ibmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -295,3 +305,89 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// 名前のハッシュ値。カーネルのdirhash()と同じもの
+uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261u;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// nb個のバケットでハッシュ値hが入るバケット。カーネルのdirbucket()と同じもの
+uint
+dirbucket(uint h, uint nb)
+{
+  uint m, b;
+
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  b = h & (m-1);
+  if(b < nb - m)
+    b = h & (2*m-1);
+  return b;
+}
+
+// バケットを1つ増やし、nb - 2^L番のバケットのエントリを振り分け直す
+void
+dirsplit(struct dinode *din)
+{
+  struct dirent src[DPB], dst[DPB];
+  uint nb, m, s, a, b, i, j;
+
+  nb = xint(din->size) / BSIZE;
+  for(m = 1; m*2 <= nb; m *= 2)
+    ;
+  s = nb - m;
+  a = ibmap(din, s);
+  b = ibmap(din, nb);
+  din->size = xint((nb+1) * BSIZE);
+  rsect(a, src);
+  bzero(dst, sizeof(dst));
+  for(i = j = 0; i < DPB; i++){
+    if(src[i].inum == 0 || dirbucket(dirhash(src[i].name), nb+1) != nb)
+      continue;
+    dst[j++] = src[i];
+    bzero(&src[i], sizeof(src[i]));
+  }
+  wsect(a, src);
+  wsect(b, dst);
+}
+
+// ディレクトリdinumにエントリを加える。配置はカーネルのdirlink()と同じ
+void
+dirappend(uint dinum, char *name, uint inum)
+{
+  struct dinode din;
+  struct dirent de[DPB];
+  uint h, x, i, used;
+
+  rinode(dinum, &din);
+  h = dirhash(name);
+  if(xint(din.size) == 0){
+    ibmap(&din, 0);
+    din.size = xint(BSIZE);
+  }
+  x = ibmap(&din, dirbucket(h, xint(din.size) / BSIZE));
+  rsect(x, de);
+  for(i = used = 0; i < DPB; i++)
+    if(de[i].inum != 0)
+      used++;
+  if(used >= DIRSPLIT){
+    dirsplit(&din);
+    x = ibmap(&din, dirbucket(h, xint(din.size) / BSIZE));
+    rsect(x, de);
+  }
+  for(i = 0; i < DPB && de[i].inum != 0; i++)
+    ;
+  assert(i < DPB);
+  de[i].inum = xshort(inum);
+  strncpy(de[i].name, name, DIRSIZ);
+  wsect(x, de);
+  winode(dinum, &din);
+}
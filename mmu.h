@@ -95,6 +95,12 @@ struct segdesc {
 #define PTE_W           0x002   // 書き込み可能
 #define PTE_U           0x004   // ユーザ
 #define PTE_PS          0x080   // ページサイズ
+#define PTE_COW         0x200   // copy-on-writeで共有中(OSが自由に使えるビット)
+
+// Page fault error code bits.
+#define FEC_PR          0x001   // 保護違反によるフォルト(0ならページが存在しない)
+#define FEC_WR          0x002   // 書き込みによるフォルト
+#define FEC_U           0x004   // ユーザモードで発生したフォルト
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF) // ページテーブルもしくはページディレクトリのエントリ内のアドレス(上位20bit)
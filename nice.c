@@ -0,0 +1,21 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+// nice prio command [args...]
+// 基準の優先度をprio(0が最高)にしてcommandを実行する
+int
+main(int argc, char **argv)
+{
+  if(argc < 3){
+    printf(2, "usage: nice prio command [args...]\n");
+    exit();
+  }
+  if(setpriority(getpid(), atoi(argv[1])) < 0){
+    printf(2, "nice: bad priority %s\n", argv[1]);
+    exit();
+  }
+  exec(argv[2], argv+2);
+  printf(2, "nice: exec %s failed\n", argv[2]);
+  exit();
+}
@@ -3,12 +3,19 @@
 #define NCPU          8  // CPU数の最大値
 #define NOFILE       16  // プロセスがオープンできるファイル数
 #define NFILE       100  // システムがオープンできるファイル数
-#define NINODE       50  // アクティブ(キャッシュされている)な"inode"の最大数
+#define NINODE       50  // キャッシュする"inode"の最小数(実際の数はiinit()が決める)
+#define INODEMEM     64  // 起動時の空きメモリの1/INODEMEMまでをinodeのキャッシュに使う
 #define NDEV         10  // "major device number"の最大数
 #define ROOTDEV       1  // ルートディスクのファイルシステムのデバイス番号
 #define MAXARG       32  // 指定可能な引数の最大数
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // ディスク上にあるログの最大ブロック数
-#define NBUF         (MAXOPBLOCKS*3)  // ディスクのブロックキャッシュの最大数
-#define FSSIZE       1000  // 複数ブロック内にあるファイルシステムのサイズ
+#define MAXOPDATA    64  // 1つの操作が書くファイルのデータブロックの最大数(ログには書かない)
+#define LOGDATA      512 // 1つのトランザクションが書き戻すデータブロックの最大数
+#define LOGMAX       1000  // カーネルが扱えるログの最大ブロック数(実際の数はスーパーブロックにある)
+#define NBUFMAX      4096  // ディスクのブロックキャッシュの最大数
+#define BUFMEM       16  // 起動時の空きメモリの1/BUFMEMまでをブロックキャッシュに使う
+#define FSSIZE       4000  // 複数ブロック内にあるファイルシステムのサイズ
+#define MAXRUN       16  // readi()が1回のディスク要求でまとめて読む最大ブロック数
+#define RAMIN        4   // 順に読まれ始めたファイルを先読みするブロック数
+#define RAMAX        64  // 先読みの窓の最大ブロック数
 
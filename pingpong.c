@@ -0,0 +1,86 @@
+// コンテキストスイッチの遅延を測る。
+// 2つのプロセスが2本のパイプで1バイトをNROUND回往復させ、1秒あたりの
+// 往復数と1回の切り替えの時間を表示する。同時に動かす組の数は1, 2, 4と変える
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NROUND 2000  // 往復の回数/組
+#define HZ     100   // 1秒あたりのtick数(おおよそ)
+
+// 1組のプロセスの処理。子が受け取った1バイトを送り返し、親が時間を計る
+void
+pair(void)
+{
+  int a[2], b[2], i, pid;
+  char c;
+
+  if(pipe(a) < 0 || pipe(b) < 0){
+    printf(1, "pingpong: pipe failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(1, "pingpong: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < NROUND; i++){
+      if(read(a[0], &c, 1) != 1 || write(b[1], &c, 1) != 1){
+        printf(1, "pingpong: child i/o failed\n");
+        exit();
+      }
+    }
+    exit();
+  }
+  c = 'x';
+  for(i = 0; i < NROUND; i++){
+    if(write(a[1], &c, 1) != 1 || read(b[0], &c, 1) != 1){
+      printf(1, "pingpong: parent i/o failed\n");
+      exit();
+    }
+  }
+  wait();
+  exit();
+}
+
+// npair組を同時に走らせ、往復の速度を表示する
+void
+run(int npair)
+{
+  int i, pid, start, elapsed, total;
+
+  start = uptime();
+  for(i = 0; i < npair; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(1, "pingpong: fork failed\n");
+      exit();
+    }
+    if(pid == 0)
+      pair();
+  }
+  for(i = 0; i < npair; i++)
+    wait();
+  elapsed = uptime() - start;
+  if(elapsed == 0)
+    elapsed = 1;
+
+  total = npair * NROUND;
+  printf(1, "%d pairs: %d round trips in %d ticks, %d round trips/sec, %d us/switch\n",
+         npair, total, elapsed, total * HZ / elapsed,
+         elapsed * (1000000 / HZ) / (2 * total));
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  printf(1, "pingpong starting\n");
+  for(n = 1; n <= 4; n *= 2)
+    run(n);
+  printf(1, "pingpong ok\n");
+  exit();
+}
@@ -6,12 +6,65 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
-
+#include "traps.h"
+
+// プロセス毎のロックplock[i]はproc[i]のstate, chan, killedを保護する。
+// 動作中のプロセスは自身のロックを保持したままsched()でスケジューラに切り替え、
+// スケジューラがそのロックを解放する。よって他のCPUがロックを取得できた時には
+// そのプロセスのカーネルスタックはもう使われていない。
+// (proc.hはspinlock.hより先にインクルードされることがあるため、
+// ロックはproc構造体に埋め込まずにここに置く)
+//
+// vmlock[i]はproc[i]をleaderとするアドレス空間(ページテーブルとsz)を保護し、
+// 同じページテーブルを共有するスレッドのページフォルトやsbrk()を直列化する。
 struct {
-  struct spinlock lock; // スピンロック
+  struct spinlock plock[NPROC]; // プロセス毎のロック
+  struct spinlock vmlock[NPROC]; // アドレス空間毎のロック
   struct proc proc[NPROC]; // システム上で生成可能なプロセス数分のプロセス構造体変数
 } ptable; // Process Table ??
 
+// 親子関係(p->parent)を保護し、wait()がexit()による起床を取りこぼさないようにする。
+// プロセスのロックより先に取得する。
+static struct spinlock waitlock;
+
+// CPU毎の実行キュー。優先度のレベル毎にRUNNABLEなプロセスをrqnextで繋いだFIFO。
+// プロセスのロックを保持した状態で取得する。
+// スケジューラはロックを取らずにnを覗き、空でないキューだけをロックする。
+//
+// p->prio, p->slice, p->boostはプロセスを所有している者だけが書き換える:
+// 実行中であればそのCPU、キューに入っている間はキューのロックの保持者。
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  volatile int n;       // キューの長さ(全レベルの合計)
+};
+static struct runq runq[NCPU];
+
+// chanでハッシュしたスリープ中のプロセスの待ちキュー。
+// wakeup()はchanのキューに繋がったプロセスだけを調べる。
+// キューのロックはプロセスのロックより先に取得する。
+// キューから外すのは通常wakeup()だが、kill()で起こされた場合は
+// sleep()から戻る時に自分で外す。
+#define NSLEEPQ 61
+#define SQHASH(chan) (((uint)(chan) >> 2) % NSLEEPQ)
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;   // sqnextで繋いだプロセス
+};
+static struct sleepq sleepq[NSLEEPQ];
+
+// futexのロック。ワードのアドレスでハッシュする。
+// 値の確認からsleep()までの間にfutexwake()が割り込まないようにする
+#define NFUTEX 31
+#define FUTEXHASH(a) (((uint)(a) >> 2) % NFUTEX)
+static struct spinlock futexlock[NFUTEX];
+
+// 優先度を戻した回数。これとp->boostが異なるプロセスは次に
+// キューに入る時かtickを数える時に基準の優先度に戻る
+static volatile uint boostgen;
+
 // initプロセス
 static struct proc *initproc;
 
@@ -19,14 +72,177 @@ int nextpid = 1; // 次に生成したプロセスに割り当てるPID
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
+// pのロック
+static struct spinlock*
+plock(struct proc *p)
+{
+  return &ptable.plock[p - ptable.proc];
+}
+
+// pのアドレス空間のロック
+struct spinlock*
+vmlock(struct proc *p)
+{
+  return &ptable.vmlock[p->leader - ptable.proc];
+}
 
 // process table用のロックを初期化
 void
 pinit(void)
 {
-  // "ptable"の名前でロックを初期化
-  initlock(&ptable.lock, "ptable");
+  int i;
+
+  for(i = 0; i < NPROC; i++){
+    initlock(&ptable.plock[i], "proc");
+    initlock(&ptable.vmlock[i], "vm");
+  }
+  initlock(&waitlock, "wait");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  for(i = 0; i < NFUTEX; i++)
+    initlock(&futexlock[i], "futex");
+}
+
+// 優先度を戻す時期を過ぎていればpを基準の優先度に戻す。
+// pを所有していること
+static void
+checkboost(struct proc *p)
+{
+  if(p->boost != boostgen){
+    p->boost = boostgen;
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+  if(p->prio < p->nice) // setpriority()で基準が下がった
+    p->prio = p->nice;
+}
+
+// pをrqのp->prioのレベルの末尾に繋ぐ。rq->lockを保持していること
+static void
+rqappend(struct runq *rq, struct proc *p)
+{
+  int l = p->prio;
+
+  p->rqnext = 0;
+  if(rq->tail[l])
+    rq->tail[l]->rqnext = p;
+  else
+    rq->head[l] = p;
+  rq->tail[l] = p;
+}
+
+// CPU cpuの実行キューにプロセスを入れた後に呼ぶ。
+// そのCPUが停止していればIPIで起こし、動作中であれば停止している他のCPUを
+// 1つ起こしてプロセスを奪わせる。scheduler()のidleの設定と対になっており、
+// キューへの追加とidleの読み込みの間にメモリバリアを置くことで、
+// 相手がキューを空と見て停止した場合には必ずidleが見える。
+static void
+kickidle(int cpu)
+{
+  int i, me, target;
+
+  __sync_synchronize();
+  me = cpuid();
+  target = -1;
+  if(cpus[cpu].idle)
+    target = cpu;
+  else {
+    for(i = 0; i < ncpu; i++){
+      if(i != me && i != cpu && cpus[i].idle){
+        target = i;
+        break;
+      }
+    }
+  }
+  if(target >= 0)
+    lapicipi(cpus[target].apicid, T_IRQ0 + IRQ_WAKEUP);
+  // 時刻を数えるCPU0がtickを止めていれば、プロセスが動き出す前に
+  // 起こして定期的な割り込みに戻させる
+  if(target != 0 && me != 0 && cpus[0].tickless)
+    lapicipi(cpus[0].apicid, T_IRQ0 + IRQ_WAKEUP);
+}
+
+// CPU0がtickを止めてよいか。CPU0以外が全て停止していて、どの実行キューも空であること。
+// tickslessを立ててから呼ぶ。kickidle()と対になっており、キューを先に、
+// idleを後に読むことで、他のCPUが奪ったプロセスを見逃さない
+static int
+canstoptick(void)
+{
+  int i;
+
+  __sync_synchronize();
+  for(i = 0; i < ncpu; i++)
+    if(runq[i].n > 0)
+      return 0;
+  for(i = 1; i < ncpu; i++)
+    if(!cpus[i].idle)
+      return 0;
+  return 1;
+}
+
+// 実行可能になったpをp->cpuの実行キューの末尾に入れる。
+// pのロックを保持していること
+static void
+runqadd(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+
+  acquire(&rq->lock);
+  checkboost(p);
+  rqappend(rq, p);
+  rq->n++;
+  release(&rq->lock);
+}
+
+// runqadd()し、停止しているCPUがあれば起こす
+static void
+runqput(struct proc *p)
+{
+  runqadd(p);
+  kickidle(p->cpu);
+}
+
+// rqの最も優先度の高いレベルの先頭のプロセスを取り出す。空なら0を返す
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p;
+  int l;
+
+  if(rq->n == 0) // ロックを取る前に覗いて空のキューではロックしない
+    return 0;
+  p = 0;
+  acquire(&rq->lock);
+  for(l = 0; l < NPRIO; l++){
+    if((p = rq->head[l]) != 0){
+      rq->head[l] = p->rqnext;
+      if(rq->head[l] == 0)
+        rq->tail[l] = 0;
+      rq->n--;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// CPU idが次に動かすプロセスを選ぶ。自分のキューが空であれば
+// 他のCPUのキューから奪う。どこにもなければ0を返す
+static struct proc*
+runqget(int id)
+{
+  struct proc *p;
+  int i;
+
+  if((p = runqpop(&runq[id])) != 0)
+    return p;
+  for(i = 1; i < ncpu; i++){
+    if((p = runqpop(&runq[(id + i) % ncpu])) != 0)
+      return p;
+  }
+  return 0;
 }
 
 // 割り込みを禁止した状態で呼び出さなければならない
@@ -82,22 +298,30 @@ allocproc(void)
   struct proc *p;
   char *sp;
 
-  acquire(&ptable.lock); // ページテーブルをロック
-
   // プロセステーブルをトラバースしステータスが"UNUSED"のプロセスを見つける。
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
     if(p->state == UNUSED)
       goto found;
-
-  release(&ptable.lock); // ページテーブルをアンロック
+    release(plock(p));
+  }
   return 0;
 
 found: // プロセスを見つられれば
 
   p->state = EMBRYO; // ??
-  p->pid = nextpid++; // PIDの割り当て
-
-  release(&ptable.lock); // ページテーブルのロック
+  p->pid = __sync_fetch_and_add(&nextpid, 1); // PIDの割り当て
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->boost = boostgen;
+  p->cpu = cpuid(); // 最初は作成したCPUのキューに入れる(plockの取得で割り込みは禁止されている)
+  p->leader = p;
+  p->ustack = 0;
+  p->tlbpending = 0;
+  p->futex = 0;
+
+  release(plock(p));
 
   // カーネルスタックの確保
   if((p->kstack = kalloc()) == 0){
@@ -165,32 +389,87 @@ userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  acquire(plock(p));
 
   p->state = RUNNABLE;
+  runqput(p);
 
-  release(&ptable.lock);
+  release(plock(p));
+}
+
+// カーネル内だけで動作するプロセスを作成し、fnを実行させる。
+// fnから戻ってはならない。成功すればPIDを、失敗すれば-1を返す。
+int
+kproc(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+
+  // ユーザ空間は持たないがswitchuvm()のためにカーネル部分だけのページテーブルを持つ
+  if((p->pgdir = setupkvm()) == 0){
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return -1;
+  }
+  p->sz = 0;
+  p->parent = 0;
+
+  // forkret()からtrapretではなくfnに戻るようにする(allocprocを参照)
+  *(uint*)((char*)p->context + sizeof(*p->context)) = (uint)fn;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(plock(p));
+
+  p->state = RUNNABLE;
+  runqput(p);
+
+  release(plock(p));
+
+  return p->pid;
 }
 
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// 成功すれば元のサイズを、失敗すれば-1を返す。
+// 伸ばす場合はサイズを増やすだけで、実際のページは最初にアクセスされた時に
+// ページフォルトから割り当てる(trap.c)。縮める場合は即座にページを解放する。
+// アドレス空間を共有する全てのスレッドのszを揃える。
 int
 growproc(int n)
 {
-  uint sz;
+  uint sz, oldsz;
   struct proc *curproc = myproc();
+  struct proc *p;
 
-  sz = curproc->sz;
+  acquire(vmlock(curproc));
+  sz = oldsz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if(sz + n < sz || sz + n >= KERNBASE)
+      goto bad;
+    sz += n;
   } else if(n < 0){
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+      goto bad;
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
-  return 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
+    if(p->state != UNUSED && p->leader == curproc->leader)
+      p->sz = sz;
+    release(plock(p));
+  }
+  release(vmlock(curproc));
+  if(n < 0){
+    switchuvm(curproc);
+    tlbshootdown(curproc->pgdir);
+  }
+  return oldsz;
+
+bad:
+  release(vmlock(curproc));
+  return -1;
 }
 
 // Create a new process copying p as the parent.
@@ -199,8 +478,9 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
-  struct proc *np;
+  int i, n, pid;
+  uint futexva[NPROC];
+  struct proc *p, *np;
   struct proc *curproc = myproc();
 
   // Allocate process.
@@ -209,14 +489,25 @@ fork(void)
   }
 
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  // copyuvm()は親のページを読み取り専用にするので、同じページテーブルを
+  // 使っているスレッドのTLBも消去する。
+  // futexで待っているスレッドがいるページは、COWにすると親が書き込んだ時に
+  // 物理ページが変わって起こせなくなるので、子にコピーを渡して親はそのまま使う
+  acquire(vmlock(curproc));
+  n = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->leader == curproc->leader && p->futex)
+      futexva[n++] = p->futexva;
+  np->pgdir = copyuvm(curproc->pgdir, curproc->sz, futexva, n);
+  np->sz = curproc->sz;
+  release(vmlock(curproc));
+  if(np->pgdir == 0){
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
-  np->sz = curproc->sz;
-  np->parent = curproc;
+  tlbshootdown(curproc->pgdir);
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
@@ -229,17 +520,147 @@ fork(void)
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
+  // 基準の優先度は引き継ぐ
+  np->nice = np->prio = curproc->nice;
+
   pid = np->pid;
 
-  acquire(&ptable.lock);
+  acquire(&waitlock);
+  np->parent = curproc;
+  release(&waitlock);
+
+  acquire(plock(np));
 
   np->state = RUNNABLE;
+  runqput(np);
 
-  release(&ptable.lock);
+  release(plock(np));
 
   return pid;
 }
 
+// 現在のプロセスとアドレス空間を共有するスレッドを作り、fn(arg1, arg2)を実行させる。
+// stackはユーザスタックとして使う1ページの先頭のアドレス。
+// fnから戻ると不正なアドレスに飛ぶので、スレッドはexit()で終わること。
+// ファイルディスクリプタとカレントディレクトリはfork()と同様に複製する。
+// スレッドの親はプロセス(leader)になり、join()で回収する。
+int
+clone(void (*fn)(void*, void*), void *arg1, void *arg2, void *stack)
+{
+  int i, pid;
+  uint sp, ustack[3];
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  if((uint)stack + PGSIZE < (uint)stack || (uint)stack + PGSIZE > curproc->sz)
+    return -1;
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  // leaderを設定するとgrowproc()がszを更新するようになる
+  acquire(vmlock(curproc));
+  np->pgdir = curproc->pgdir;
+  np->sz = curproc->sz;
+  np->leader = curproc->leader;
+  release(vmlock(curproc));
+
+  // fnの戻り先と引数を積む
+  ustack[0] = 0xffffffff;
+  ustack[1] = (uint)arg1;
+  ustack[2] = (uint)arg2;
+  sp = (uint)stack + PGSIZE - sizeof(ustack);
+  if(copyout(np->pgdir, sp, ustack, sizeof(ustack)) < 0){
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->leader = np;
+    np->state = UNUSED;
+    return -1;
+  }
+
+  *np->tf = *curproc->tf;
+  np->tf->eip = (uint)fn;
+  np->tf->esp = sp;
+  np->ustack = stack;
+
+  for(i = 0; i < NOFILE; i++)
+    if(curproc->ofile[i])
+      np->ofile[i] = filedup(curproc->ofile[i]);
+  np->cwd = idup(curproc->cwd);
+
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  np->nice = np->prio = curproc->nice;
+
+  pid = np->pid;
+
+  acquire(&waitlock);
+  np->parent = np->leader;
+  release(&waitlock);
+
+  acquire(plock(np));
+
+  np->state = RUNNABLE;
+  runqput(np);
+
+  release(plock(np));
+
+  return pid;
+}
+
+// ZOMBIEのpを回収してUNUSEDに戻す。waitlockとpのロックを保持していること。
+// スレッドのページテーブルはleaderのものなので解放しない
+static void
+freeproc(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  if(p->leader == p)
+    freevm(p->pgdir);
+  p->pgdir = 0;
+  p->leader = p;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->state = UNUSED;
+}
+
+// 現在のプロセスのスレッドを全てkillし、終了を待って回収する。
+// ページテーブルを解放したり置き換えたりする前に呼ぶ
+void
+reapthreads(void)
+{
+  struct proc *p;
+  struct proc *curproc = myproc();
+  int n;
+
+  acquire(&waitlock);
+  for(;;){
+    n = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p == curproc || p->parent != curproc || p->leader != curproc)
+        continue;
+      acquire(plock(p));
+      if(p->state == ZOMBIE){
+        freeproc(p);
+      } else {
+        n++;
+        p->killed = 1;
+        if(p->state == SLEEPING){
+          p->state = RUNNABLE;
+          runqput(p);
+        }
+      }
+      release(plock(p));
+    }
+    if(n == 0)
+      break;
+    sleep(curproc, &waitlock);
+  }
+  release(&waitlock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -253,6 +674,10 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  // スレッドを残したままページテーブルを解放させない
+  if(curproc->leader == curproc)
+    reapthreads();
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -266,22 +691,24 @@ exit(void)
   end_op();
   curproc->cwd = 0;
 
-  acquire(&ptable.lock);
-
-  // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  acquire(&waitlock);
 
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
       p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
+      wakeup(initproc); // 既にZOMBIEかもしれない
     }
   }
 
-  // Jump into the scheduler, never to return.
+  // Parent might be sleeping in wait().
+  wakeup(curproc->parent);
+
+  acquire(plock(curproc));
   curproc->state = ZOMBIE;
+  release(&waitlock);
+
+  // Jump into the scheduler, never to return.
   sched();
   panic("zombie exit");
 }
@@ -295,39 +722,107 @@ wait(void)
   int havekids, pid;
   struct proc *curproc = myproc();
   
-  acquire(&ptable.lock);
+  acquire(&waitlock);
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+      // スレッドはjoin()で回収する
+      if(p->parent != curproc || p->leader != p)
         continue;
       havekids = 1;
+      // 子がまだexit()やswtch()の途中でないことをロックで確かめる
+      acquire(plock(p));
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        release(&ptable.lock);
+        freeproc(p);
+        release(plock(p));
+        release(&waitlock);
         return pid;
       }
+      release(plock(p));
     }
 
     // No point waiting if we don't have any children.
     if(!havekids || curproc->killed){
-      release(&ptable.lock);
+      release(&waitlock);
+      return -1;
+    }
+
+    // Wait for children to exit.  (See wakeup call in proc_exit.)
+    sleep(curproc, &waitlock);  //DOC: wait-sleep
+  }
+}
+
+// 同じプロセスのスレッドが終了するのを待って回収し、そのpidを返す。
+// *stackにはclone()に渡されたユーザスタックを返す。
+// 待つスレッドがなければ-1を返す。
+int
+join(void **stack)
+{
+  struct proc *p;
+  int havethreads, pid;
+  struct proc *curproc = myproc();
+  struct proc *leader = curproc->leader;
+
+  acquire(&waitlock);
+  for(;;){
+    havethreads = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p == curproc || p == leader || p->parent != leader || p->leader != leader)
+        continue;
+      havethreads = 1;
+      acquire(plock(p));
+      if(p->state == ZOMBIE){
+        pid = p->pid;
+        *stack = p->ustack;
+        freeproc(p);
+        release(plock(p));
+        release(&waitlock);
+        return pid;
+      }
+      release(plock(p));
+    }
+
+    if(!havethreads || curproc->killed){
+      release(&waitlock);
       return -1;
     }
 
-    // Wait for children to exit.  (See wakeup1 call in proc_exit.)
-    sleep(curproc, &ptable.lock);  //DOC: wait-sleep
+    // スレッドはexit()で親であるleaderを起こす
+    sleep(leader, &waitlock);
+  }
+}
+
+// pgdirを使っている他のCPUのTLBをIPIで消去させ、完了を待つ(TLB shootdown)。
+// 相手が割り込みを受け付けるまで待つので、スピンロックを保持せずに呼ぶこと
+void
+tlbshootdown(pde_t *pgdir)
+{
+  struct cpu *c;
+  uint gen[NCPU];
+  int sent[NCPU];
+  int i;
+
+  if(!(readeflags() & FL_IF))
+    panic("tlbshootdown");
+  pushcli();
+  __sync_synchronize();
+  for(i = 0; i < ncpu; i++){
+    c = &cpus[i];
+    sent[i] = 0;
+    if(c != mycpu() && c->proc && c->proc->pgdir == pgdir){
+      gen[i] = c->tlbgen;
+      lapicipi(c->apicid, T_IRQ0 + IRQ_TLBFLUSH);
+      sent[i] = 1;
+    }
   }
+  popcli();
+  for(i = 0; i < ncpu; i++)
+    if(sent[i])
+      while(cpus[i].tlbgen == gen[i])
+        ;
 }
 
 //PAGEBREAK: 42
@@ -343,38 +838,66 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = c - cpus;
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
-
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
+    cli();
+
+    // 自分の実行キュー(空なら他のCPUのキュー)の先頭のプロセスを選ぶ
+    if((p = runqget(id)) == 0){
+      // 実行可能なプロセスがなければ割り込みかwakeup()等からのIPIが
+      // 来るまで停止する。idleを立ててからキューを見直すことで、
+      // その間にキューに入ったプロセスを見逃さない(kickidle()を参照)
+      c->idle = 1;
+      __sync_synchronize();
+      if((p = runqget(id)) == 0){
+        // 停止している間は定期的なタイマ割り込みを止める。
+        // CPU0は他に動いているCPUがない場合に限り、次のsleep()の期限まで止める
+        c->tickless = 1;
+        if(id == 0 && !canstoptick())
+          c->tickless = 0;
+        if(c->tickless)
+          timeridle();
+        stihlt();
+        cli();
+        c->idle = 0;
+        if(c->tickless){
+          c->tickless = 0;
+          timerresume();
+        }
         continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
-
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+      }
+      c->idle = 0;
     }
-    release(&ptable.lock);
 
+    // 別のCPUでsched()の途中であれば、切り替え終わってロックが
+    // 解放されるまで待つことになる
+    acquire(plock(p));
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
+    p->cpu = id;
+
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(plock(p));
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only the process's lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -387,8 +910,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(plock(p)))
+    panic("sched p->lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -404,10 +927,95 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+
+  acquire(plock(p));  //DOC: yieldlock
+  p->state = RUNNABLE;
+  runqadd(p); // このCPUはすぐにスケジューラに入るので他のCPUは起こさない
   sched();
-  release(&ptable.lock);
+  release(plock(p));
+}
+
+// タイマ割り込み毎に各CPUで呼ばれる。実行中のプロセスがタイムスライスを
+// 使い切れば優先度を1つ下げてCPUを譲る。使い切っていなくても、より高い
+// レベルのプロセスがこのCPUのキューで待っていれば譲る。
+// スリープしてもsliceは戻さないため、タイムスライスの直前にスリープして
+// 高い優先度に居座ることはできない。
+void
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq;
+  int l;
+
+  if(p == 0 || p->state != RUNNING)
+    return;
+  checkboost(p);
+  if(++p->slice >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    yield();
+    return;
+  }
+  rq = &runq[p->cpu];
+  for(l = 0; l < p->prio; l++){
+    if(rq->head[l]){ // ロックなしで覗くだけ
+      yield();
+      return;
+    }
+  }
+}
+
+// 飢餓を防ぐためにBOOSTTICKS毎にCPU0のタイマ割り込みから呼ばれ、全ての
+// プロセスを基準の優先度に戻す。キューで待っているプロセスはここで
+// 基準のレベルに移し、それ以外はboostgenを見て自分で戻る。
+void
+schedboost(void)
+{
+  struct runq *rq;
+  struct proc *p, *next;
+  int i, l;
+
+  boostgen++;
+  for(i = 0; i < ncpu; i++){
+    rq = &runq[i];
+    if(rq->n == 0)
+      continue;
+    acquire(&rq->lock);
+    for(l = 1; l < NPRIO; l++){
+      p = rq->head[l];
+      rq->head[l] = rq->tail[l] = 0;
+      for(; p; p = next){
+        next = p->rqnext;
+        checkboost(p);
+        rqappend(rq, p);
+      }
+    }
+    release(&rq->lock);
+  }
+}
+
+// pidのプロセスの基準の優先度をprioにし、以前の値を返す
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->nice;
+      p->nice = prio; // 現在の優先度には次にキューに入るかtickを数える時に反映される
+      release(plock(p));
+      return old;
+    }
+    release(plock(p));
+  }
+  return -1;
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -416,8 +1024,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding p->lock from scheduler.
+  release(plock(myproc()));
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -437,6 +1045,8 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc(); // カレントプロセスを取得
+  struct sleepq *sq = &sleepq[SQHASH(chan)];
+  struct proc **pp;
 
   // カレントプロセスを取得できなかった場合
   if(p == 0)
@@ -447,50 +1057,131 @@ sleep(void *chan, struct spinlock *lk)
     panic("sleep without lk");
 
   // p->stateを変更し、sched()を呼び出すため
-  // ptable.lockを獲得しなければならない
-  // ptable.lockを保持するとwakeup()で起こされる
-  // ことが保証され(wakeup()はptable.lockが取得された状態で動作する)
-  // よってロックを開放しても問題がない
-  if(lk != &ptable.lock){  // ptableのロックでなかった場合
-    acquire(&ptable.lock);  // ptableのロックを取得
-    release(lk); // 関連のないであろうロックを開放
-  }
+  // pのロックを獲得しなければならない
+  // lkを開放する前にchanの待ちキューに繋ぐため
+  // wakeup()で起こされることが保証され
+  // (wakeup()はキューが空かを覗き、空でなければキューのロックと
+  // pのロックを取得して状態を調べる)
+  // よってlkを開放しても問題がない
+  acquire(&sq->lock);
+  acquire(plock(p));  //DOC: sleeplock1
+
   // スリープへ
   p->chan = chan; // チャンネルを設定
   p->state = SLEEPING; // ステートをスリープ状態に
+  p->sqnext = sq->head;
+  sq->head = p;
+  p->sqlinked = 1;
 
-  sched(); // 再スケジューリング
+  release(lk);
+  release(&sq->lock);
 
-  // チャンネルをクリア
-  p->chan = 0;
+  sched(); // 再スケジューリング
 
   // 元々取得していたロックを再要求
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock); // ptable.lockを開放
-    acquire(lk); // 元々取得していたロックを再度取得
+  release(plock(p));
+
+  // kill()で起こされた場合はまだ待ちキューに繋がっている
+  if(p->sqlinked){
+    acquire(&sq->lock);
+    for(pp = &sq->head; *pp; pp = &(*pp)->sqnext){
+      if(*pp == p){
+        *pp = p->sqnext;
+        p->sqlinked = 0;
+        break;
+      }
+    }
+    release(&sq->lock);
   }
+  p->chan = 0; // チャンネルをクリア
+
+  acquire(lk); // 元々取得していたロックを再度取得
 }
 
 //PAGEBREAK!
-// chan上でスリープしているプロセスを全て起床させる。
-// ptableがロックされている必要がある
-static void wakeup1(void *chan)
+// chanでスリープしているプロセスを最大n個(nが負なら全て)起こし、起こした数を返す。
+// 起床したプロセスは最後に動作したCPUの実行キューに入る。
+static int
+wakeupn(void *chan, int n)
 {
-  struct proc *p;
+  struct sleepq *sq = &sleepq[SQHASH(chan)];
+  struct proc *p, **pp;
+  int woken;
 
-  // プロセステーブルのプロセスをトラバース
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan) // chanが同一でスリープしている場合
+  if(sq->head == 0) // 誰もスリープしていなければロックも取らない
+    return 0;
+
+  woken = 0;
+  acquire(&sq->lock);
+  // chanのハッシュが同じ待ちキューだけをトラバース
+  for(pp = &sq->head; (p = *pp) != 0 && woken != n; ){
+    if(p->chan != chan){
+      pp = &p->sqnext;
+      continue;
+    }
+    *pp = p->sqnext;
+    p->sqlinked = 0;
+    acquire(plock(p));
+    if(p->state == SLEEPING){ // kill()で既に起こされていなければ
       p->state = RUNNABLE; // "実行可能"にする
+      runqput(p);
+      woken++;
+    }
+    release(plock(p));
+  }
+  release(&sq->lock);
+  return woken;
 }
 
 // Wake up all processes sleeping on chan.
 void
 wakeup(void *chan)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  wakeupn(chan, -1);
+}
+
+// ユーザのアドレスvaのワードkaddr(カーネルのアドレス)の値がvalであれば
+// futexwake()されるまで眠る。値が異なるか、uva2kaw()の後にfork()でページが
+// COWになっていれば眠らずに-1を返す。呼び出し側は戻った後に値を確かめ直すこと
+int
+futexwait(uint va, uint *kaddr, uint val)
+{
+  struct spinlock *lk = &futexlock[FUTEXHASH(kaddr)];
+  struct proc *p = myproc();
+
+  acquire(lk);
+  // vmlockの下で登録し、fork()がこのページをCOWにしないようにする
+  acquire(vmlock(p));
+  if(!uvmwritable(p->pgdir, va, (char*)kaddr)){
+    release(vmlock(p));
+    release(lk);
+    return -1;
+  }
+  p->futex = kaddr;
+  p->futexva = va;
+  release(vmlock(p));
+  if(*(volatile uint*)kaddr != val || p->killed){
+    p->futex = 0;
+    release(lk);
+    return -1;
+  }
+  sleep(kaddr, lk);
+  p->futex = 0;
+  release(lk);
+  return 0;
+}
+
+// ワードkaddrでfutexwait()しているプロセスを最大n個起こし、起こした数を返す
+int
+futexwake(uint *kaddr, int n)
+{
+  struct spinlock *lk = &futexlock[FUTEXHASH(kaddr)];
+  int woken;
+
+  acquire(lk);
+  woken = wakeupn(kaddr, n);
+  release(lk);
+  return woken;
 }
 
 // Kill the process with the given pid.
@@ -501,18 +1192,20 @@ kill(int pid)
 {
   struct proc *p;
 
-  acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
     if(p->pid == pid){
       p->killed = 1;
       // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
+      if(p->state == SLEEPING){
         p->state = RUNNABLE;
-      release(&ptable.lock);
+        runqput(p);
+      }
+      release(plock(p));
       return 0;
     }
+    release(plock(p));
   }
-  release(&ptable.lock);
   return -1;
 }
 
@@ -543,7 +1236,7 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
+    cprintf("%d %s %s prio %d", p->pid, state, p->name, p->prio);
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
@@ -8,6 +8,9 @@ struct cpu {
   int ncli;                    // pushcliネスト数
   int intena;                  // pushcliの前段階で割り込みが可能かどうか?
   struct proc *proc;           // このプロセッサで動作しているプロセスまたはNULL
+  volatile int idle;           // 実行可能なプロセスがなくhltで停止している(または停止しようとしている)
+  volatile int tickless;       // 停止中で定期的なタイマ割り込みを止めている
+  volatile uint tlbgen;        // TLB shootdownのIPIを処理した回数
 };
 
 extern struct cpu cpus[NCPU]; // CPU個数分定義される(最大8)
@@ -27,6 +30,13 @@ struct context {
   uint eip; // Instruction Pointer
 };
 
+// スケジューラの優先度のレベル数(0が最高)。
+// レベルlのタイムスライスはQUANTUM(l)tickで、使い切ると1つ下のレベルに下がる。
+// BOOSTTICKS毎に全てのプロセスを基準のレベル(nice)に戻して飢餓を防ぐ。
+#define NPRIO       4
+#define QUANTUM(l)  (1 << (l))
+#define BOOSTTICKS  100
+
 // プロセスの状態
 // UNUSED: 使用されていない
 // EMBRYO: ??
@@ -51,6 +61,19 @@ struct proc {
   struct file *ofile[NOFILE];  // プロセスがオープン可能なファイル数
   struct inode *cwd;           // カレントディレクトリ
   char name[16];               // プロセス名(デバッグ用)
+  int cpu;                     // 最後に動作した(実行可能な間は所属する実行キューの)CPU
+  struct proc *rqnext;         // 実行キューの次のプロセス
+  int prio;                    // 現在の優先度のレベル
+  int nice;                    // 基準の優先度のレベル(setpriority()で設定する)
+  int slice;                   // 現在のレベルで使用したtick数
+  uint boost;                  // 最後に優先度を戻された時のboostgen
+  struct proc *sqnext;         // 同じ待ちキューでスリープしている次のプロセス
+  int sqlinked;                // 待ちキューに繋がっている
+  struct proc *leader;         // アドレス空間を所有するプロセス(スレッドでなければ自分自身)
+  void *ustack;                // clone()で渡されたユーザスタック
+  int tlbpending;              // スピンロック保持中にCOWのページをコピーし、shootdownが済んでいない
+  uint *futex;                 // 0でない場合futexwait()でこのワードを待っている
+  uint futexva;                // 待っているワードのユーザのアドレス
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -54,3 +54,66 @@ int holdingsleep(struct sleeplock *lk)
 
 
 
+// 読み書きスリープロックの初期化
+void initrwsleeplock(struct rwsleeplock *lk, char *name)
+{
+  initlock(&lk->lk, "rwsleep lock");
+  lk->name = name;
+  lk->readers = 0;
+  lk->writer = 0;
+  lk->wwait = 0;
+  lk->pid = 0;
+}
+
+// 読み手として取得する。書き手が保持しているか待っている間はスリープする
+void acquirerdsleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  while (lk->writer || lk->wwait)
+    sleep(lk, &lk->lk);
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void releaserdsleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  if (lk->readers < 1)
+    panic("releaserdsleep");
+  if (--lk->readers == 0)
+    wakeup(lk); // 待っている書き手を起こす
+  release(&lk->lk);
+}
+
+// 書き手として取得する。読み手と書き手が全て抜けるまでスリープする
+void acquirewrsleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->wwait++;
+  while (lk->writer || lk->readers)
+    sleep(lk, &lk->lk);
+  lk->wwait--;
+  lk->writer = 1;
+  lk->pid = myproc()->pid;
+  release(&lk->lk);
+}
+
+void releasewrsleep(struct rwsleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->writer = 0;
+  lk->pid = 0;
+  wakeup(lk); // 待っている読み手と書き手を起こす
+  release(&lk->lk);
+}
+
+// カレントプロセスが書き手としてロックを保持しているかどうか
+int holdingwrsleep(struct rwsleeplock *lk)
+{
+  int r;
+
+  acquire(&lk->lk);
+  r = lk->writer && (lk->pid == myproc()->pid);
+  release(&lk->lk);
+  return r;
+}
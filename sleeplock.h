@@ -8,3 +8,17 @@ struct sleeplock {
   char *name;        // ロックの名前.
   int pid;           // ロックを保持しているプロセスのPID
 };
+
+// 読み手と書き手のスリープロック。読み手は同時に何人でも保持できる。
+// 書き手が待っている間は新たな読み手を通さないので、書き手は飢えない。
+// そのため読み手として保持したまま同じロックを読み手として取り直してはいけない
+struct rwsleeplock {
+  struct spinlock lk; // このロックを保護するためのスピンロック
+  int readers;        // 保持している読み手の数
+  int writer;         // 書き手が保持している
+  int wwait;          // 待っている書き手の数
+
+  // デバッグ用:
+  char *name;         // ロックの名前
+  int pid;            // 書き手として保持しているプロセスのPID
+};
@@ -9,13 +9,54 @@
 #include "proc.h"
 #include "spinlock.h"
 
+// ロックの競合の統計。同じ名前のロック(例えば全てのプロセスのロック)は
+// 1つの種類として集計する。カウンタはCPU毎に持ち、アトミック命令も
+// キャッシュラインの取り合いも起こさないようにする。
+// 種類が足りなくなれば0番("other")にまとめる。
+#define NLOCKCLASS 32
+
+struct lockcount {
+  uint acquire;             // 取得した回数
+  uint contend;             // 取得時に他が保持していた回数
+  unsigned long long spin;  // 待っていたクロック数
+};
+
+static struct {
+  uint lock;                      // classnameを保護する(xchgで直接取る)
+  int n;
+  char *name[NLOCKCLASS];
+  struct lockcount count[NCPU][NLOCKCLASS];
+} lockstat = { .n = 1, .name = { "other" } };
+
+// nameの種類の番号を返す。なければ登録する
+static int
+lockclass(char *name)
+{
+  int i;
+
+  while(xchg(&lockstat.lock, 1) != 0)
+    ;
+  for(i = 1; i < lockstat.n; i++)
+    if(strncmp(lockstat.name[i], name, 16) == 0)
+      break;
+  if(i == lockstat.n){
+    if(lockstat.n < NLOCKCLASS)
+      lockstat.name[lockstat.n++] = name;
+    else
+      i = 0;
+  }
+  xchg(&lockstat.lock, 0);
+  return i;
+}
 
 // スピンロック変数の初期化関数
 void initlock(struct spinlock *lk, char *name)
 {
   lk->name = name; // ロックの名前
-  lk->locked = 0; // ロックが取得されているかどうか
+  lk->next = 0; // 空き
+  lk->owner = 0;
   lk->cpu = 0; // CPU番号
+  lk->class = lockclass(name);
 }
 
 // ロックを取得する
@@ -25,13 +66,28 @@ void initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  struct lockcount *lc;
+  struct cpu *c;
+  unsigned long long t0;
+  uint ticket;
+
   pushcli(); // デッドロックを回避するため割り込みを禁止する
   if(holding(lk)) // ロックが取得されているかどうか
     panic("acquire");
+  c = mycpu();
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0) // スピンロック(値が1である間ループする)
-    ;
+  // チケットを取り、自分の番が来るまで待つ。
+  // 待つ間はownerを読むだけなので、他のCPUのキャッシュを無効化しない
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  lc = &lockstat.count[c - cpus][lk->class];
+  lc->acquire++;
+  if(lk->owner != ticket){
+    lc->contend++;
+    t0 = rdtsc();
+    while(lk->owner != ticket)
+      pause();
+    lc->spin += rdtsc() - t0;
+  }
 
   // ロックを取得した後クリティカルセクション内のメモリ参照が発生することを保証するため、
   // コンパイラにこれ以前にロードまたはストア命令を並び替えないように指示する。  
@@ -39,7 +95,7 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for debugging.
   // デバッグのためロック取得時の情報を記録する
-  lk->cpu = mycpu(); // ロックを取得しているCPUを更新
+  lk->cpu = c; // ロックを取得しているCPUを更新
   getcallerpcs(&lk, lk->pcs); // コールトレースのための情報を記録
 }
 
@@ -59,10 +115,9 @@ release(struct spinlock *lk)
   // Cコンパイラ及びハードウェアはおそらくロードやストア命令を並び替える。これを__sync_synchronize()によって阻止する
   __sync_synchronize();
 
-  // ロックを開放する、lk->locked = 0と等価。
-  // このコードはアトミックに処理されない可能性あるためC言語からは使用できない。
-  // 実際のOSではCのアトミックを使用する。
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // 次のチケットの持ち主にロックを渡す。
+  // ownerを書き換えるのは保持者だけなので、アトミックな加算は必要ない。
+  lk->owner = lk->owner + 1;
 
   popcli(); // 割り込み禁止カウンタをデクリメント
 }
@@ -93,11 +148,106 @@ holding(struct spinlock *lock)
 {
   int r;
   pushcli(); // 割り込みの禁止
-  r = lock->locked && lock->cpu == mycpu(); // CPUがカレントCPUで且つロックされているかどうか
+  r = lock->next != lock->owner && lock->cpu == mycpu(); // CPUがカレントCPUで且つロックされているかどうか
   popcli(); // 割り込み許可
   return r; // ロックが取得されているかどうか
 }
 
+// 読み書きスピンロックの初期化
+void
+initrwlock(struct rwspinlock *lk, char *name)
+{
+  lk->name = name;
+  lk->cnt = 0;
+  lk->cpu = 0;
+}
+
+// 読み手として取得する。書き手が保持しているか待っている間はスピンする
+void
+acquirerd(struct rwspinlock *lk)
+{
+  pushcli();
+  for(;;){
+    while(lk->cnt & (RW_WRITER|RW_WAIT))
+      pause();
+    if((__sync_fetch_and_add(&lk->cnt, 1) & (RW_WRITER|RW_WAIT)) == 0)
+      break;
+    __sync_fetch_and_sub(&lk->cnt, 1); // 書き手に先を越された
+  }
+  __sync_synchronize();
+}
+
+void
+releaserd(struct rwspinlock *lk)
+{
+  if((lk->cnt & ~(RW_WRITER|RW_WAIT)) == 0)
+    panic("releaserd");
+  __sync_fetch_and_sub(&lk->cnt, 1);
+  popcli();
+}
+
+// 書き手として取得する。読み手がいなくなるまでRW_WAITを立ててスピンする
+void
+acquirewr(struct rwspinlock *lk)
+{
+  uint c;
+
+  pushcli();
+  if(lk->cpu == mycpu() && (lk->cnt & RW_WRITER))
+    panic("acquirewr");
+  for(;;){
+    c = lk->cnt;
+    if((c & ~RW_WAIT) == 0){
+      if(__sync_bool_compare_and_swap(&lk->cnt, c, RW_WRITER))
+        break;
+    } else if(!(c & RW_WAIT))
+      __sync_bool_compare_and_swap(&lk->cnt, c, c | RW_WAIT);
+    pause();
+  }
+  __sync_synchronize();
+  lk->cpu = mycpu();
+}
+
+void
+releasewr(struct rwspinlock *lk)
+{
+  if(!(lk->cnt & RW_WRITER) || lk->cpu != mycpu())
+    panic("releasewr");
+  lk->cpu = 0;
+  // 待っている他の書き手が立てたRW_WAITは残す
+  __sync_fetch_and_and(&lk->cnt, ~RW_WRITER);
+  popcli();
+}
+
+// ロックの種類毎の統計を表示し、カウンタを0に戻す。コンソールで^Lを押すと呼ばれる。
+// 前回の表示からの取得回数、競合した回数、待っていたクロック数(1024クロック単位)を示す。
+// ロックを取らずに読むので、動作中のCPUの数え途中の値が混じることがある
+void
+lockdump(void)
+{
+  struct lockcount *lc;
+  uint acq, con;
+  unsigned long long spin;
+  int i, c;
+
+  for(i = 0; i < lockstat.n; i++){
+    acq = con = 0;
+    spin = 0;
+    for(c = 0; c < ncpu; c++){
+      lc = &lockstat.count[c][i];
+      acq += lc->acquire;
+      con += lc->contend;
+      spin += lc->spin;
+      lc->acquire = lc->contend = 0;
+      lc->spin = 0;
+    }
+    if(acq == 0)
+      continue;
+    cprintf("%s: acquire %d contend %d kcycles %d\n",
+            lockstat.name[i], acq, con, (uint)(spin >> 10));
+  }
+}
+
 // pushcli/popcliはマッチする以外はcli/sti命令と同様の動作をする命令である。
 // 2回分のpushcli()開放するには2回分のpopcli()を必要とする。もし割り込みが禁止されていれば
 // pushcli, popcli共に割り込みを禁止したままとなる。
@@ -1,10 +1,28 @@
 // 排他制御用のロック構造体
+// チケットロック: 取得する側はnextからチケットを取り、ownerが
+// そのチケットになるまで待つ。取得は到着順になる。
 struct spinlock {
-  uint locked;       // ロックされているか
+  volatile uint next;  // 次に発行するチケット
+  volatile uint owner; // ロックを保持しているチケット(next == ownerなら空き)
 
   // For debugging:
   char *name;        // ロックの名前
   struct cpu *cpu;   // ロックを保持しているCPU
   uint pcs[10];      // ロックを取得している関数のコールスタック
+  int class;         // 統計を集計するロックの種類(spinlock.cのlockstatを参照)
 };
 
+// 読み手と書き手のスピンロック。読み手は同時に何人でも保持できる。
+// cntの下位ビットは保持している読み手の数で、書き手が待ち始めると
+// RW_WAITを立てて新たな読み手を止める。読み手として保持したまま
+// 同じロックを読み手として取り直してはいけない
+#define RW_WRITER 0x80000000  // 書き手が保持している
+#define RW_WAIT   0x40000000  // 書き手が待っている
+
+struct rwspinlock {
+  volatile uint cnt;
+
+  // For debugging:
+  char *name;        // ロックの名前
+  struct cpu *cpu;   // 書き手として保持しているCPU
+};
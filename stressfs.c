@@ -16,16 +16,18 @@
 int
 main(int argc, char *argv[])
 {
-  int fd, i;
+  int fd, i, me, start;
   char path[] = "stressfs0";
   char data[512];
 
   printf(1, "stressfs starting\n");
   memset(data, 'a', sizeof(data));
+  start = uptime();
 
   for(i = 0; i < 4; i++)
     if(fork() > 0)
       break;
+  me = i;
 
   printf(1, "write %d\n", i);
 
@@ -45,5 +47,10 @@ main(int argc, char *argv[])
 
   wait();
 
+  // the first process waits for the whole chain of children
+  if(me == 0)
+    printf(1, "stressfs: %d bytes in %d ticks\n",
+           5 * 2 * 20 * sizeof(data), uptime() - start);
+
   exit();
 }
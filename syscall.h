@@ -20,3 +20,9 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_fsync  22
+#define SYS_setpriority 23
+#define SYS_clone  24
+#define SYS_join   25
+#define SYS_futex  26
+#define SYS_getdents 27
@@ -73,7 +73,7 @@ sys_read(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argwptr(1, &p, n) < 0)
     return -1;
   return fileread(f, p, n);
 }
@@ -109,11 +109,38 @@ sys_fstat(void)
   struct file *f;
   struct stat *st;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argfd(0, 0, &f) < 0 || argwptr(1, (void*)&st, sizeof(*st)) < 0)
     return -1;
   return filestat(f, st);
 }
 
+// ディレクトリfdから使われているエントリ(struct dirent)をnバイト分まで読む。
+// 読んだバイト数を返し、最後まで読んだら0を返す
+int
+sys_getdents(void)
+{
+  struct file *f;
+  int n;
+  char *p;
+
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argwptr(1, &p, n) < 0)
+    return -1;
+  return filereaddir(f, p, n);
+}
+
+// これまでに完了したファイルシステムの更新がディスクにコミットされるまで待つ。
+// ログは全体で1つなのでfdに関係なく全ての更新が対象になる。
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -165,17 +192,19 @@ bad:
 }
 
 // Is the directory dp empty except for "." and ".." ?
+// "."と".."はバケットの分割で移ることがあるので名前で見分ける
 static int
 isdirempty(struct inode *dp)
 {
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
+  uint off;
+  int i, n;
+  struct dirent de[3];
+
+  off = 0;
+  while((n = dirread(dp, (char*)de, &off, sizeof(de))) > 0){
+    for(i = 0; i < n/sizeof(de[0]); i++)
+      if(namecmp(de[i].name, ".") != 0 && namecmp(de[i].name, "..") != 0)
+        return 0;
   }
   return 1;
 }
@@ -218,6 +247,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcacheenter(dp->dev, dp->inum, name, 0, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -275,8 +305,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  // 名前のバケットが埋まっていれば作ったinodeを解放して失敗する
+  if(dirlink(dp, name, ip->inum) < 0){
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -427,7 +467,7 @@ sys_pipe(void)
   struct file *rf, *wf;
   int fd0, fd1;
 
-  if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
+  if(argwptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
   if(pipealloc(&rf, &wf) < 0)
     return -1;
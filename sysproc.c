@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "futex.h"
 
 int
 sys_fork(void)
@@ -36,12 +37,76 @@ sys_kill(void)
   return kill(pid);
 }
 
+// pidのプロセスの基準の優先度(0が最高, NPRIO-1が最低)を設定し、以前の値を返す
+int
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+// clone(fn, arg1, arg2, stack)
+int
+sys_clone(void)
+{
+  int fn, arg1, arg2, stack;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg1) < 0 ||
+     argint(2, &arg2) < 0 || argint(3, &stack) < 0)
+    return -1;
+  return clone((void(*)(void*, void*))fn, (void*)arg1, (void*)arg2, (void*)stack);
+}
+
+// join(&stack)
+int
+sys_join(void)
+{
+  void **stack;
+  void *ustack;
+  int pid;
+
+  if(argwptr(0, (void*)&stack, sizeof(*stack)) < 0)
+    return -1;
+  if((pid = join(&ustack)) >= 0)
+    *stack = ustack;
+  return pid;
+}
+
+// futex(addr, op, val)
+// ワードは物理アドレス(に対応するカーネルのアドレス)で識別する
+int
+sys_futex(void)
+{
+  int addr, op, val;
+  uint *kaddr;
+  struct proc *curproc = myproc();
+
+  if(argint(0, &addr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0)
+    return -1;
+  if(addr % 4 != 0 || (uint)addr >= curproc->sz || (uint)addr + 4 > curproc->sz)
+    return -1;
+  if((kaddr = (uint*)uva2kaw(curproc->pgdir, addr)) == 0)
+    return -1;
+  switch(op){
+  case FUTEX_WAIT:
+    return futexwait(addr, kaddr, val);
+  case FUTEX_WAKE:
+    return futexwake(kaddr, val);
+  }
+  return -1;
+}
+
 int
 sys_getpid(void)
 {
   return myproc()->pid;
 }
 
+// ヒープを伸ばす場合はサイズを増やすだけで、実際のページは
+// 最初にアクセスされた時にページフォルトから割り当てる(growproc()を参照)。
 int
 sys_sbrk(void)
 {
@@ -50,8 +115,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if((addr = growproc(n)) < 0)
     return -1;
   return addr;
 }
@@ -60,21 +124,10 @@ int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return sleepticks(n);
 }
 
 // return how many clock tick interrupts have occurred
@@ -15,6 +15,16 @@ extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 
+// sleep()システムコールのタイマ。期限の早い順にtimerqに繋ぎ、tickslockで保護する。
+// CPU0のtick割り込みは期限の来たタイマだけを起こすので、
+// 眠っているプロセスが毎tick起こされることはない
+struct timer {
+  uint expire;          // 期限のticks
+  int queued;           // timerqに繋がっている
+  struct timer *next;
+};
+static struct timer *timerq;
+
 // 割り込み・トラップゲート及びtick割り込み用のロックの初期化
 void
 tvinit(void)
@@ -37,15 +47,112 @@ idtinit(void)
   lidt(idt, sizeof(idt));
 }
 
+// ticksをn進め、期限の来たタイマのプロセスを起こす。tickslockを保持していること。
+// 優先度を戻す時期(BOOSTTICKSの倍数)を過ぎれば1を返す
+static int
+tickadvance(uint n)
+{
+  struct timer *t;
+  uint old = ticks;
+
+  ticks += n;
+  while((t = timerq) != 0 && (int)(ticks - t->expire) >= 0){
+    timerq = t->next;
+    t->queued = 0;
+    wakeup(t);
+  }
+  return ticks / BOOSTTICKS != old / BOOSTTICKS;
+}
+
+// n tick眠る。killされた場合は-1を返す
+int
+sleepticks(int n)
+{
+  struct timer t, **pp;
+
+  if(n <= 0)
+    return 0;
+  acquire(&tickslock);
+  t.expire = ticks + n;
+  for(pp = &timerq; *pp && (int)((*pp)->expire - t.expire) <= 0; pp = &(*pp)->next)
+    ;
+  t.next = *pp;
+  t.queued = 1;
+  *pp = &t;
+  // CPU0がtickを止めて停止していれば、設定した期限より早く起きる必要がある
+  if(pp == &timerq && cpus[0].tickless)
+    lapicipi(cpus[0].apicid, T_IRQ0 + IRQ_WAKEUP);
+  while(t.queued){
+    if(myproc()->killed){
+      for(pp = &timerq; *pp != &t; pp = &(*pp)->next)
+        ;
+      *pp = t.next;
+      release(&tickslock);
+      return -1;
+    }
+    sleep(&t, &tickslock);
+  }
+  release(&tickslock);
+  return 0;
+}
+
+// 停止するCPUのタイマを設定する(scheduler()から割り込み禁止で呼ばれる)。
+// 時刻を数えるCPU0は次のタイマの期限に1回だけ割り込み、他のCPUはタイマを止める
+void
+timeridle(void)
+{
+  uint n;
+
+  if(cpuid() != 0){
+    lapiconeshot(0);
+    return;
+  }
+  acquire(&tickslock);
+  n = 0xffffffff;  // タイマがなければ数えられる最大まで
+  if(timerq){
+    n = timerq->expire - ticks;
+    if((int)n < 1)
+      n = 1;
+  }
+  lapiconeshot(n);
+  release(&tickslock);
+}
+
+// 停止から戻ったCPUのタイマを定期的な割り込みに戻す。
+// CPU0は停止していた間のtick数だけticksを進める
+void
+timerresume(void)
+{
+  uint n;
+  int boost;
+
+  n = lapicperiodic();
+  if(cpuid() != 0 || n == 0)
+    return;
+  acquire(&tickslock);
+  boost = tickadvance(n);
+  release(&tickslock);
+  if(boost)
+    schedboost();
+}
+
 //PAGEBREAK: 41
 void
 trap(struct trapframe *tf)
 {
+  int boost, r;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
     myproc()->tf = tf;
     syscall();
+    // システムコール中にスピンロックを保持したままCOWのページをコピーしていれば、
+    // ロックを手放した今、ユーザに戻る前に他のCPUのTLBから元のページを消す
+    if(myproc()->tlbpending){
+      myproc()->tlbpending = 0;
+      tlbshootdown(myproc()->pgdir);
+    }
     if(myproc()->killed)
       exit();
     return;
@@ -53,11 +160,14 @@ trap(struct trapframe *tf)
 
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
-    if(cpuid() == 0){
+    // tickを止めて停止している間の割り込みはワンショットの期限によるもので、
+    // 経過時間はtimerresume()でまとめて数える
+    if(cpuid() == 0 && !mycpu()->tickless){
       acquire(&tickslock);
-      ticks++;
-      wakeup(&ticks);
+      boost = tickadvance(1);
       release(&tickslock);
+      if(boost)
+        schedboost();
     }
     lapiceoi();
     break;
@@ -76,6 +186,16 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_WAKEUP:
+    // hltから抜けてスケジューラが実行キューを見直すだけでよい
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_TLBFLUSH:
+    // 他のCPUが同じアドレス空間のページテーブルを書き換えた
+    lcr3(rcr3());
+    mycpu()->tlbgen++;
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -83,6 +203,28 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // copy-on-writeで共有しているページへの書き込みであれば
+    // ページを複製してフォルトした命令を再実行する。
+    // カーネルがシステムコール中にユーザメモリへ書き込んだ場合もここに来る。
+    if(myproc() && (tf->err & FEC_WR) && (r = cowfault(myproc()->pgdir, rcr2())) >= 0){
+      // ページをコピーした場合、同じアドレス空間の他のスレッドのTLBには
+      // 元のページが残っている。スピンロックを保持していなければすぐに消去させ、
+      // 保持していればシステムコールから戻る時まで延ばす
+      if(r > 0 && (tf->eflags & FL_IF)){
+        sti();
+        tlbshootdown(myproc()->pgdir);
+        cli();
+      } else if(r > 0)
+        myproc()->tlbpending = 1;
+      break;
+    }
+    // sbrk()で伸ばしたがまだ触れていないヒープであれば0のページを割り当てる
+    if(myproc() && !(tf->err & FEC_PR) && rcr2() < myproc()->sz &&
+       lazyfault(myproc()->pgdir, rcr2()) == 0)
+      break;
+    // それ以外のページフォルトは不正なトラップとして扱う
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -107,9 +249,10 @@ trap(struct trapframe *tf)
 
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
+  // タイムスライスを使い切っていればyield()する(schedtick()を参照)。
   if(myproc() && myproc()->state == RUNNING &&
      tf->trapno == T_IRQ0+IRQ_TIMER)
-    yield();
+    schedtick();
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
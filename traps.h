@@ -34,5 +34,7 @@
 #define IRQ_COM1         4 // UART
 #define IRQ_IDE         14 // 
 #define IRQ_ERROR       19 // エラー
+#define IRQ_WAKEUP      20 // 停止しているCPUを起こすIPI(proc.cを参照)
+#define IRQ_TLBFLUSH    21 // TLBを消去させるIPI(tlbshootdown()を参照)
 #define IRQ_SPURIOUS    31 // 仮
 
@@ -3,6 +3,7 @@
 #include "fcntl.h"
 #include "user.h"
 #include "x86.h"
+#include "futex.h"
 
 char*
 strcpy(char *s, const char *t)
@@ -105,3 +106,78 @@ memmove(void *vdst, const void *vsrc, int n)
     *dst++ = *src++;
   return vdst;
 }
+
+// futexを使ったmutex。stateは0: 空き、1: ロック中、2: ロック中で待っているスレッドがいる。
+// 競合がなければシステムコールを発行しない
+// (U. Drepper, "Futexes Are Tricky"のmutex2)
+void
+mutex_init(mutex_t *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(mutex_t *m)
+{
+  uint c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = xchg(&m->state, 2);
+  while(c != 0){
+    futex(&m->state, FUTEX_WAIT, 2);
+    c = xchg(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(mutex_t *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    m->state = 0;
+    futex(&m->state, FUTEX_WAKE, 1);
+  }
+}
+
+// 条件変数。seqをsignal毎に進め、待つ側はmutexを外す前に読んだseqで眠る。
+// 待っているスレッドがいなければcond_signal()はシステムコールを発行しない
+void
+cond_init(cond_t *c)
+{
+  c->seq = 0;
+  c->waiters = 0;
+}
+
+// mを保持して呼ぶ。戻った時もmを保持している。
+// 起こされても条件が成り立っているとは限らないので、呼び出し側で確かめ直すこと
+void
+cond_wait(cond_t *c, mutex_t *m)
+{
+  uint seq;
+
+  __sync_fetch_and_add(&c->waiters, 1);
+  seq = c->seq;
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT, seq);
+  // 他に待っているスレッドがいるかもしれないので、2としてロックを取る
+  while(xchg(&m->state, 2) != 0)
+    futex(&m->state, FUTEX_WAIT, 2);
+  __sync_fetch_and_sub(&c->waiters, 1);
+}
+
+void
+cond_signal(cond_t *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  if(c->waiters > 0)
+    futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void
+cond_broadcast(cond_t *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  if(c->waiters > 0)
+    futex(&c->seq, FUTEX_WAKE, c->waiters);
+}
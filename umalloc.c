@@ -20,9 +20,10 @@ typedef union header Header;
 
 static Header base;
 static Header *freep;
+static lock_t mlock;  // スレッドから同時に呼ばれてもよいようにする
 
-void
-free(void *ap)
+static void
+ufree(void *ap)
 {
   Header *bp, *p;
 
@@ -56,12 +57,12 @@ morecore(uint nu)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  ufree((void*)(hp + 1));
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+static void*
+umalloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
@@ -88,3 +89,22 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+void
+free(void *ap)
+{
+  lock_acquire(&mlock);
+  ufree(ap);
+  lock_release(&mlock);
+}
+
+void*
+malloc(uint nbytes)
+{
+  void *p;
+
+  lock_acquire(&mlock);
+  p = umalloc(nbytes);
+  lock_release(&mlock);
+  return p;
+}
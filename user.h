@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct dirent;
 
 // system calls
 int fork(void);
@@ -23,6 +24,12 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int fsync(int);
+int setpriority(int, int);
+int clone(void(*)(void*, void*), void*, void*, void*);
+int join(void**);
+int futex(volatile uint*, int, uint);
+int getdents(int, struct dirent*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -37,3 +44,27 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+typedef struct {
+  volatile uint state;
+} mutex_t;
+typedef struct {
+  volatile uint seq;
+  volatile uint waiters;
+} cond_t;
+void mutex_init(mutex_t*);
+void mutex_lock(mutex_t*);
+void mutex_unlock(mutex_t*);
+void cond_init(cond_t*);
+void cond_wait(cond_t*, mutex_t*);
+void cond_signal(cond_t*);
+void cond_broadcast(cond_t*);
+
+// uthread.c
+typedef struct {
+  volatile uint locked;
+} lock_t;
+void lock_init(lock_t*);
+void lock_acquire(lock_t*);
+void lock_release(lock_t*);
+int thread_create(void(*)(void*), void*);
+int thread_join(void);
@@ -4,6 +4,7 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "futex.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
@@ -184,6 +185,10 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+// writetest1()で書くファイルの512バイト単位の数。
+// MAXFILEはディスクより大きいため、二重間接ブロックを使う所まで書く
+#define BIGCHUNKS ((NDIRECT + NINDIRECT + NINDIRECT/2) * (BSIZE/512))
+
 void
 writetest1(void)
 {
@@ -197,7 +202,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGCHUNKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +222,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGCHUNKS){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -931,6 +936,82 @@ bigdir(void)
   printf(1, "bigdir ok\n");
 }
 
+// getdents()で大きなディレクトリ(複数のバケット)の全エントリが読めるか
+void
+getdentstest(void)
+{
+  enum { N = 300 };
+  int i, n, fd, cnt;
+  char name[16];
+  struct dirent de[20];
+
+  printf(1, "getdents test\n");
+
+  if(mkdir("gd") != 0){
+    printf(1, "getdents mkdir failed\n");
+    exit();
+  }
+  fd = open("gd/f", O_CREATE);
+  if(fd < 0){
+    printf(1, "getdents create failed\n");
+    exit();
+  }
+  close(fd);
+  strcpy(name, "gd/");
+  for(i = 0; i < N; i++){
+    name[3] = 'y';
+    name[4] = '0' + (i / 64);
+    name[5] = '0' + (i % 64);
+    name[6] = '\0';
+    if(link("gd/f", name) != 0){
+      printf(1, "getdents link failed\n");
+      exit();
+    }
+  }
+
+  fd = open("gd", 0);
+  if(getdents(fd, de, sizeof(de[0]) - 1) != 0){
+    printf(1, "getdents short buffer failed\n");
+    exit();
+  }
+  cnt = 0;
+  while((n = getdents(fd, de, sizeof(de))) > 0){
+    for(i = 0; i < n/sizeof(de[0]); i++){
+      if(de[i].inum == 0){
+        printf(1, "getdents returned a free entry\n");
+        exit();
+      }
+      cnt++;
+    }
+  }
+  close(fd);
+  if(cnt != N + 3){ // ".", ".."とf
+    printf(1, "getdents read %d entries, want %d\n", cnt, N + 3);
+    exit();
+  }
+
+  if(unlink("gd") == 0){
+    printf(1, "getdents unlink non-empty dir succeeded\n");
+    exit();
+  }
+  for(i = 0; i < N; i++){
+    name[3] = 'y';
+    name[4] = '0' + (i / 64);
+    name[5] = '0' + (i % 64);
+    name[6] = '\0';
+    if(unlink(name) != 0){
+      printf(1, "getdents unlink failed\n");
+      exit();
+    }
+  }
+  if(unlink("gd/f") != 0 || unlink("gd") != 0){
+    printf(1, "getdents unlink dir failed\n");
+    exit();
+  }
+
+  printf(1, "getdents ok\n");
+}
+
 void
 subdir(void)
 {
@@ -1147,9 +1228,10 @@ bigwrite(void)
 void
 bigfile(void)
 {
-  int fd, i, total, cc;
+  int fd, i, total, cc, start;
 
   printf(1, "bigfile test\n");
+  start = uptime();
 
   unlink("bigfile");
   fd = open("bigfile", O_CREATE | O_RDWR);
@@ -1197,7 +1279,7 @@ bigfile(void)
   }
   unlink("bigfile");
 
-  printf(1, "bigfile test ok\n");
+  printf(1, "bigfile test ok (%d ticks)\n", uptime() - start);
 }
 
 void
@@ -1347,7 +1429,7 @@ iref(void)
 
   printf(1, "empty file name\n");
 
-  // the 50 is NINODE
+  // the 50 is NINODE (the smallest inode cache)
   for(i = 0; i < 50 + 1; i++){
     if(mkdir("irefd") != 0){
       printf(1, "mkdir irefd failed\n");
@@ -1546,6 +1628,289 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// setpriority() should reject bad priorities and report the old one,
+// and a CPU-bound child at the lowest priority must not keep its
+// parent from running.
+void
+prioritytest(void)
+{
+  int pid;
+
+  printf(stdout, "priority test\n");
+  if(setpriority(getpid(), -1) != -1 || setpriority(getpid(), 100) != -1){
+    printf(stdout, "setpriority accepted a bad priority\n");
+    exit();
+  }
+  if(setpriority(getpid(), 1) != 0 || setpriority(getpid(), 0) != 1){
+    printf(stdout, "setpriority returned wrong old priority\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    setpriority(getpid(), 3);
+    for(;;)
+      ;
+  }
+  sleep(10);
+  kill(pid);
+  wait();
+  printf(stdout, "priority ok\n");
+}
+
+// threads made by clone() share memory: counters updated under a
+// lock must add up, and memory one thread gets from sbrk() must be
+// visible to the others.
+#define NTHREAD 4
+#define NINCR   10000
+
+static lock_t tlock;
+static volatile int tcount;
+static volatile char *tmem;
+
+static void
+threadincr(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NINCR; i++){
+    lock_acquire(&tlock);
+    tcount++;
+    lock_release(&tlock);
+  }
+  if((int)arg == 0){
+    tmem = sbrk(4096);
+    tmem[0] = 'x';
+  }
+}
+
+void
+threadtest(void)
+{
+  int i;
+
+  printf(stdout, "thread test\n");
+  if(join(0) != -1){
+    printf(stdout, "join without threads succeeded\n");
+    exit();
+  }
+  lock_init(&tlock);
+  tcount = 0;
+  tmem = 0;
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_create(threadincr, (void*)i) < 0){
+      printf(stdout, "thread_create failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < NTHREAD; i++){
+    if(thread_join() < 0){
+      printf(stdout, "thread_join failed\n");
+      exit();
+    }
+  }
+  if(thread_join() != -1){
+    printf(stdout, "thread_join returned an extra thread\n");
+    exit();
+  }
+  if(tcount != NTHREAD*NINCR){
+    printf(stdout, "thread counter %d, expected %d\n", tcount, NTHREAD*NINCR);
+    exit();
+  }
+  if(tmem == 0 || tmem[0] != 'x'){
+    printf(stdout, "memory from sbrk() in a thread not shared\n");
+    exit();
+  }
+  printf(stdout, "thread ok\n");
+}
+
+// mutex/condvar built on futex(): a mutex-protected counter must add
+// up, and a consumer waiting on a condvar must see every item.
+static mutex_t fmutex;
+static cond_t fcond;
+static volatile int fitems;
+
+static void
+futexincr(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NINCR; i++){
+    mutex_lock(&fmutex);
+    tcount++;
+    mutex_unlock(&fmutex);
+  }
+}
+
+static void
+futexproduce(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 100; i++){
+    mutex_lock(&fmutex);
+    fitems++;
+    cond_signal(&fcond);
+    mutex_unlock(&fmutex);
+  }
+}
+
+void
+futextest(void)
+{
+  static volatile uint word = 1;
+  int i, got;
+
+  printf(stdout, "futex test\n");
+  if(futex(&word, FUTEX_WAIT, 0) != -1){
+    printf(stdout, "futex wait on a changed word slept\n");
+    exit();
+  }
+  if(futex(&word, FUTEX_WAKE, 1) != 0){
+    printf(stdout, "futex woke a waiter that does not exist\n");
+    exit();
+  }
+
+  mutex_init(&fmutex);
+  tcount = 0;
+  for(i = 0; i < NTHREAD; i++)
+    if(thread_create(futexincr, 0) < 0){
+      printf(stdout, "thread_create failed\n");
+      exit();
+    }
+  for(i = 0; i < NTHREAD; i++)
+    thread_join();
+  if(tcount != NTHREAD*NINCR){
+    printf(stdout, "mutex counter %d, expected %d\n", tcount, NTHREAD*NINCR);
+    exit();
+  }
+
+  cond_init(&fcond);
+  fitems = 0;
+  if(thread_create(futexproduce, 0) < 0){
+    printf(stdout, "thread_create failed\n");
+    exit();
+  }
+  for(got = 0; got < 100; ){
+    mutex_lock(&fmutex);
+    while(fitems == 0)
+      cond_wait(&fcond, &fmutex);
+    got += fitems;
+    fitems = 0;
+    mutex_unlock(&fmutex);
+  }
+  thread_join();
+  printf(stdout, "futex ok\n");
+}
+
+// does fork() share memory copy-on-write? a process using more
+// than half of physical memory can only fork if pages are shared.
+// also reports how long such a fork takes.
+void
+cowtest(void)
+{
+  char *a, *p;
+  int pid, t0, t1;
+  uint sz;
+
+  printf(stdout, "cow test\n");
+  sz = 120*1024*1024;
+  a = sbrk(sz);
+  if(a == (char*)0xffffffff){
+    printf(stdout, "cow test: sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + sz; p += 4096)
+    *(int*)p = (uint)p;
+
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "cow test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(p = a; p < a + sz; p += 4096){
+      if(*(int*)p != (uint)p){
+        printf(stdout, "cow test: child read wrong value\n");
+        exit();
+      }
+    }
+    for(p = a; p < a + 1024*4096; p += 4096)
+      *(int*)p = 0;
+    exit();
+  }
+  wait();
+  t1 = uptime();
+
+  for(p = a; p < a + sz; p += 4096){
+    if(*(int*)p != (uint)p){
+      printf(stdout, "cow test: child write visible in parent\n");
+      exit();
+    }
+  }
+  sbrk(-sz);
+  printf(stdout, "cow test ok (fork+exit+wait of %d MB: %d ticks)\n",
+         sz/(1024*1024), t1 - t0);
+}
+
+// does sbrk() hand out memory lazily? grow far beyond physical
+// memory, touch a few pages, and let the kernel write into an
+// untouched page on our behalf.
+void
+lazytest(void)
+{
+  char *a, *p;
+  int fd, n;
+  uint sz;
+
+  printf(stdout, "lazy sbrk test\n");
+  sz = 1024*1024*1024;
+  a = sbrk(sz);
+  if(a == (char*)0xffffffff){
+    printf(stdout, "lazy sbrk test: sbrk failed\n");
+    exit();
+  }
+  for(p = a; p < a + sz; p += 64*1024*1024){
+    if(*p != 0){
+      printf(stdout, "lazy sbrk test: page not zero\n");
+      exit();
+    }
+    *p = 1;
+  }
+
+  fd = open("README", 0);
+  if(fd < 0){
+    printf(stdout, "lazy sbrk test: open README failed\n");
+    exit();
+  }
+  p = a + sz - 4096;
+  n = read(fd, p, 4096);
+  close(fd);
+  if(n <= 0 || p[0] != 'x'){
+    printf(stdout, "lazy sbrk test: read into lazy page failed\n");
+    exit();
+  }
+
+  // 物理メモリより大きなバッファはカーネルが触れる前の割り当てで失敗する
+  fd = open("README", 0);
+  n = read(fd, a, sz);
+  close(fd);
+  if(n >= 0){
+    printf(stdout, "lazy sbrk test: read into huge buffer succeeded\n");
+    exit();
+  }
+
+  if(sbrk(-sz) == (char*)0xffffffff){
+    printf(stdout, "lazy sbrk test: sbrk shrink failed\n");
+    exit();
+  }
+  printf(stdout, "lazy sbrk test ok\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,6 +2133,11 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  cowtest();
+  lazytest();
+  prioritytest();
+  threadtest();
+  futextest();
   validatetest();
 
   opentest();
@@ -1794,6 +2164,7 @@ main(int argc, char *argv[])
   iref();
   forktest();
   bigdir(); // slow
+  getdentstest();
 
   uio();
 
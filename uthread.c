@@ -0,0 +1,62 @@
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+#include "mmu.h"
+
+// clone()/join()の上に作った簡単なスレッドライブラリ。
+// スレッドは同じアドレス空間を共有し、malloc()で確保した
+// 1ページをユーザスタックとして使う。
+
+void
+lock_init(lock_t *lk)
+{
+  lk->locked = 0;
+}
+
+// スピンして獲得する
+void
+lock_acquire(lock_t *lk)
+{
+  while(xchg(&lk->locked, 1) != 0)
+    ;
+}
+
+void
+lock_release(lock_t *lk)
+{
+  xchg(&lk->locked, 0);
+}
+
+// clone()から最初に実行される。fnが戻ったらスレッドを終了する
+static void
+thread_start(void *fn, void *arg)
+{
+  ((void (*)(void*))fn)(arg);
+  exit();
+}
+
+// fn(arg)を実行するスレッドを作り、そのpidを返す
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  void *stack;
+  int pid;
+
+  if((stack = malloc(PGSIZE)) == 0)
+    return -1;
+  if((pid = clone(thread_start, (void*)fn, arg, stack)) < 0)
+    free(stack);
+  return pid;
+}
+
+// スレッドの終了を待ってスタックを解放し、そのpidを返す
+int
+thread_join(void)
+{
+  void *stack;
+  int pid;
+
+  if((pid = join(&stack)) >= 0)
+    free(stack);
+  return pid;
+}
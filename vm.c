@@ -368,31 +368,59 @@ clearpteu(pde_t *pgdir, char *uva)
 
 // Given a parent process's page table, create a copy
 // of it for a child.
+// ユーザページはコピーせず親子で共有する。書き込み可能なページは双方で
+// 読み取り専用かつPTE_COWとし、最初に書き込んだ側がcowfault()でコピーを得る。
+// ただしpriv[0..npriv-1]のアドレスを含むページは共有せず子にコピーを渡し、
+// 親のページはそのまま書き込めるようにしておく(futexで待っているワード)。
+// pgdirはカレントプロセスのページテーブルでなければならない。
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, uint sz, uint *priv, int npriv)
 {
   pde_t *d;
   pte_t *pte;
   uint pa, i, flags;
   char *mem;
+  int j;
 
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+    // sbrk()で確保済みでもまだ触れられていないページは割り当てられていない
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
-    memmove(mem, (char*)P2V(pa), PGSIZE);
-    if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
-      kfree(mem);
-      goto bad;
+
+    for(j = 0; j < npriv; j++)
+      if(PGROUNDDOWN(priv[j]) == i)
+        break;
+
+    // ユーザからアクセスできないページ(スタック直下のガードページ)は
+    // カーネルが書き込むことがあるため従来通りコピーする
+    if(!(flags & PTE_U) || (j < npriv && (flags & PTE_W))){
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, (char*)P2V(pa), PGSIZE);
+      if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
+        kfree(mem);
+        goto bad;
+      }
+      continue;
     }
+
+    if(flags & PTE_W){
+      flags = (flags & ~PTE_W) | PTE_COW;
+      *pte = pa | flags; // 親側も読み取り専用にする
+    }
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+      goto bad;
+    kdup(P2V(pa));
   }
+  lcr3(rcr3()); // 親のTLBに残っている書き込み可能なエントリを破棄する
   return d;
 
 bad:
@@ -400,6 +428,153 @@ bad:
   return 0;
 }
 
+// sbrk()で確保されたがまだ割り当てられていないページvaに
+// 0で初期化したページを割り当てる(遅延割り当て)。
+// 呼び出し側はvaがプロセスのサイズ内にあることを確認すること。
+// 同じアドレス空間の他のスレッドが先に割り当てていれば何もしない。
+// メモリが足りない場合は-1を返す。
+int
+lazyfault(pde_t *pgdir, uint va)
+{
+  char *mem;
+  pte_t *pte;
+  int r;
+
+  if(va >= KERNBASE)
+    return -1;
+  r = -1;
+  acquire(vmlock(myproc()));
+  if((pte = walkpgdir(pgdir, (void*)va, 0)) != 0 && (*pte & PTE_P)){
+    r = 0;
+    goto out;
+  }
+  if((mem = kalloc()) == 0)
+    goto out;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pgdir, (char*)PGROUNDDOWN(va), PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    goto out;
+  }
+  r = 0;
+out:
+  release(vmlock(myproc()));
+  return r;
+}
+
+// ユーザのアドレス範囲[va, va+n)のまだ割り当てていないページを割り当てる。
+// writeが真ならCOWで共有しているページもコピーしておく。
+// システムコールがユーザメモリに触れる前に呼び、カーネル内のページフォルトで
+// メモリが足りなくなることがないようにする。足りなければ-1を返す。
+// 範囲はプロセスのサイズ内であること。スピンロックを保持せずに呼ぶ。
+int
+uvmtouch(pde_t *pgdir, uint va, uint n, int write)
+{
+  uint a;
+  pte_t *pte;
+  int r;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte == 0 || !(*pte & PTE_P)){
+      if(lazyfault(pgdir, a) < 0)
+        return -1;
+    } else if(write && (*pte & PTE_COW)){
+      if((r = cowfault(pgdir, a)) < 0)
+        return -1;
+      if(r > 0)
+        tlbshootdown(pgdir);
+    }
+  }
+  return 0;
+}
+
+// copy-on-writeで共有しているページvaへの書き込みを可能にする。
+// 他に共有しているページテーブルがあればページをコピーし、
+// 最後の1つであればそのまま書き込み可能にする。
+// vaがCOWページでない、またはメモリが足りない場合は-1を返す。
+// ページをコピーした場合は1を返す(他のCPUのTLBに元のページが残っている)。
+// 同じアドレス空間の他のスレッドが先に書き込み可能にしていれば何もしない。
+int
+cowfault(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  uint pa, flags;
+  char *mem;
+  int r;
+
+  if(va >= KERNBASE)
+    return -1;
+  r = -1;
+  acquire(vmlock(myproc()));
+  if((pte = walkpgdir(pgdir, (void*)va, 0)) == 0 || !(*pte & PTE_P))
+    goto out;
+  if((*pte & (PTE_W|PTE_U)) == (PTE_W|PTE_U)){
+    r = 0;
+    goto flush;
+  }
+  if(!(*pte & PTE_COW))
+    goto out;
+  pa = PTE_ADDR(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefcnt(P2V(pa)) == 1){
+    *pte = pa | flags;
+  } else {
+    if((mem = kalloc()) == 0)
+      goto out;
+    memmove(mem, (char*)P2V(pa), PGSIZE);
+    *pte = V2P(mem) | flags;
+    kfree(P2V(pa)); // 共有していたページの参照を1つ落とす
+    r = 1;
+    goto flush;
+  }
+  r = 0;
+flush:
+  invlpg((void*)PGROUNDDOWN(va));
+out:
+  release(vmlock(myproc()));
+  return r;
+}
+
+// ユーザのアドレスvaのページをこのアドレス空間専用の書き込み可能なページにし
+// (未割り当てなら割り当て、COWならコピーする)、vaに対応するカーネルのアドレスを返す。
+// 物理ページが以後変わらないのでfutexの鍵に使える。
+// vaはプロセスのサイズ内であること。スピンロックを保持せずに呼ぶ。
+char*
+uva2kaw(pde_t *pgdir, uint va)
+{
+  pte_t *pte;
+  char *ka;
+  int r;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || !(*pte & PTE_P)){
+    if(lazyfault(pgdir, va) < 0)
+      return 0;
+  } else if(*pte & PTE_COW){
+    if((r = cowfault(pgdir, va)) < 0)
+      return 0;
+    if(r > 0)
+      tlbshootdown(pgdir);
+  }
+  if((ka = uva2ka(pgdir, (char*)PGROUNDDOWN(va))) == 0)
+    return 0;
+  return ka + (va - PGROUNDDOWN(va));
+}
+
+// ユーザのアドレスvaのページが今もkaのページに書き込み可能で写されていれば1を返す。
+// vmlockを保持して呼ぶ
+int
+uvmwritable(pde_t *pgdir, uint va, char *ka)
+{
+  pte_t *pte;
+
+  pte = walkpgdir(pgdir, (char*)va, 0);
+  if(pte == 0 || !(*pte & PTE_P) || !(*pte & PTE_W))
+    return 0;
+  return PTE_ADDR(*pte) == V2P(PGROUNDDOWN((uint)ka));
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
@@ -408,7 +583,7 @@ uva2ka(pde_t *pgdir, char *uva)
   pte_t *pte;
 
   pte = walkpgdir(pgdir, uva, 0);
-  if((*pte & PTE_P) == 0)
+  if(pte == 0 || (*pte & PTE_P) == 0) // 遅延割り当てでまだページテーブルがない場合もある
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
@@ -423,10 +598,15 @@ copyout(pde_t *pgdir, uint va, void *p, uint len)
 {
   char *buf, *pa0;
   uint n, va0;
+  pte_t *pte;
 
   buf = (char*)p;
   while(len > 0){
     va0 = (uint)PGROUNDDOWN(va);
+    // カーネルのアドレスから書き込むためCOWページは先にコピーしておく
+    pte = walkpgdir(pgdir, (char*)va0, 0);
+    if(pte && (*pte & PTE_COW) && cowfault(pgdir, va0) < 0)
+      return -1;
     pa0 = uva2ka(pgdir, (char*)va0);
     if(pa0 == 0)
       return -1;
@@ -30,12 +30,29 @@ insl(int port, void *addr, int cnt)
                "memory", "cc");
 }
 
+// 指定のポートからデータ(4バイト)を読み込む
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
 // 指定のI/Oポートにデータ(1バイト)を書き込む
 static inline void outb(ushort port, uchar data)
 {
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+// 指定のI/Oポートにデータ(4バイト)を書き込む
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 // 指定のI/Oポートにデータ(2バイト)を書き込む
 static inline void
 outw(ushort port, ushort data)
@@ -132,6 +149,15 @@ loadgs(ushort v)
   asm volatile("movw %0, %%gs" : : "r" (v));
 }
 
+// 割り込みを許可し、次の割り込みが来るまでCPUを停止する。
+// stiの直後の1命令の間は割り込みが入らないため、割り込みを禁止した状態で
+// 条件を調べてから呼べば、その後に来た割り込みを取りこぼさない
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt" : : : "memory");
+}
+
 // 割り込みの禁止
 static inline void
 cli(void)
@@ -146,6 +172,22 @@ sti(void)
   asm volatile("sti");
 }
 
+// スピンループ中であることをCPUに伝える
+static inline void
+pause(void)
+{
+  asm volatile("pause");
+}
+
+// タイムスタンプカウンタ(起動からのクロック数)を読む
+static inline unsigned long long
+rdtsc(void)
+{
+  unsigned long long t;
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
 // アドレスで指定した値とnewvalを入れ替える
 static inline uint
 xchg(volatile uint *addr, uint newval)
@@ -177,6 +219,22 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+// 現在のページディレクトリの物理アドレスを取得する
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
+// 仮想アドレスaddrに対応するTLBのエントリを無効化する
+static inline void
+invlpg(void *addr)
+{
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
 // trapasm.Sによってハードウェアのスタック上で構築され、trap()関数に
 // 渡されるトラップフレームのレイアウト。
 struct trapframe {